@@ -1,21 +1,25 @@
 #include "platform.h"
 
-// use
+// Logs are written to stderr or the -log file by a background thread, use
+// -log-level debug or
 // #define DEBUG_LOG
-// for printing logs to stderr.
+// to log every instruction.
 // Pipe the output of stderr to a log like to not break the display
-// Eg: chip8 <rom> 2> log
+// Eg: chip8 -log-level debug <rom> 2> log
 
-#ifdef DEBUG_LOG
-#define DEBUG(...)                      \
-    do {                                \
-        fprintf(stderr, __VA_ARGS__);   \
-        fprintf(stderr, "\n");          \
+// Only the format pointer and the arguments are copied on the emulation thread.
+// Arguments are integers or strings that outlive the program, passed with LOG_STR
+#define LOG(level, format, ...)                                                     \
+    do {                                                                            \
+        if ((level) <= log_level) {                                                 \
+            const uint64_t log_args[] = { 0, __VA_ARGS__ };                         \
+            log_push(format, log_args + 1, sizeof(log_args) / sizeof(log_args[0]) - 1); \
+        }                                                                           \
     } while (0)
 
-#else
-#define DEBUG(...)
-#endif
+#define LOG_STR(s)              ((uint64_t)(uintptr_t)(s))
+#define INFO(...)               LOG(LOG_INFO, __VA_ARGS__)
+#define DEBUG(...)              LOG(LOG_DEBUG, __VA_ARGS__)
 
 #define BYTE_SIZE               8
 
@@ -28,6 +32,7 @@
 #define DISPLAY_HEIGHT          32
 #define DISPLAY_SIZE            (DISPLAY_HEIGHT * DISPLAY_WIDTH)
 #define PROGRAM_START_OFFSET    512
+#define MAX_ROM_SIZE            (MEM_SIZE - PROGRAM_START_OFFSET)
 
 // display constants
 #define PIXEL_TEXT              "  "
@@ -35,7 +40,7 @@
 #define SET_WHITE_BG            ESC"[107m"
 #define SET_DEFAULT_BG          ESC"[49m"
 #define ANSI_COLOR_FORMAT_LEN   (sizeof(ANSI_COLOR_FORMAT) + 3 + sizeof(PIXEL_TEXT))
-#define MAX_FRAME_BUFFER_SIZE   (DISPLAY_SIZE * (ANSI_COLOR_FORMAT_LEN * 2) * BYTE_SIZE)
+#define MAX_FRAME_BUFFER_SIZE   (DISPLAY_SIZE * (ANSI_COLOR_FORMAT_LEN * 2) * BYTE_SIZE + DISPLAY_HEIGHT * HEATMAP_LINE_SIZE)
 
 // instruction decoding constants
 #define OP(instruction)         (instruction >> 12)
@@ -49,6 +54,115 @@
 #define DEFAULT_FPS             60
 #define DEFAULT_IPS             700
 
+// predecode constants
+#define MAX_FUSED_LEN           3
+#define MAX_STORE_LEN           REG_COUNT
+#define DEFAULT_RNG_SEED        0x2545F491
+
+// translation cache constants
+#define TCACHE_MAGIC            "C8TC"
+#define TCACHE_VERSION          2
+#define TCACHE_HOT_BLOCKS       64
+#define TCACHE_PATH_SIZE        4096
+
+// tiered engine constants
+#define TIER_HOT_THRESHOLD      32
+#define TIER_MAX_BLOCK_LEN      32
+#define TIER_WINDOW_SIZE        64
+#define TIER_PAGE_SIZE          64
+#define TIER_PAGE_COUNT         (MEM_SIZE / TIER_PAGE_SIZE)
+#define TIER_QUEUE_SIZE         64
+#define TIER_MAX_BLOCKS         1024
+
+// netplay constants
+#define NETPLAY_HISTORY         32
+#define NETPLAY_MAX_CHANGES     16
+#define NETPLAY_MAGIC           0x504E3843
+#define NETPLAY_WAIT_MS         1
+
+// governor constants, a frame is run in slices to find where the ROM went idle
+#define GOVERNOR_SLICES         16
+#define GOVERNOR_HEADROOM_DIV   2       // budget kept above the busy part, as a fraction of it
+#define GOVERNOR_SMOOTHING      8
+
+// memory search constants
+#define MEMSEARCH_MAX_FREEZES   32
+#define MEMSEARCH_MAX_LIST      32
+#define MEMSEARCH_LINE_SIZE     128
+
+// savestate archive constants
+#define ARCHIVE_MAGIC           "C8SA"
+#define ARCHIVE_VERSION         1
+#define ARCHIVE_BLOCK_SIZE      256
+#define ARCHIVE_STATE_BLOCKS    (MEM_SIZE / ARCHIVE_BLOCK_SIZE)
+#define ARCHIVE_INDEX_SIZE      (1 << 22)   // hash slots, a power of two
+#define ARCHIVE_MAX_BLOCKS      (ARCHIVE_INDEX_SIZE / 4 * 3)
+
+// timeline constants
+#define TRACE_MAX_EVENTS        (1 << 18)   // per thread, later events are dropped
+
+// latency histogram constants, values in ns are kept within 1/LATENCY_SUB_COUNT
+#define LATENCY_SUB_BITS        5
+#define LATENCY_SUB_COUNT       (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS        40      // about 18 minutes, longer values are clamped
+#define LATENCY_BUCKETS         ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+// scheduler constants
+#define SCHED_MAX_INSTANCES     (1 << 16)
+#define SCHED_WHEEL_SIZE        64      // ticks an instance can sleep, a power of two
+#define SCHED_NONE              UINT32_MAX
+
+// instance pool constants
+#define POOL_ALIGN              64      // every object starts on a cache line
+#define POOL_NONE               UINT32_MAX
+#define POOL_BENCH_INSTANCES    8192
+#define POOL_BENCH_CYCLES       1000000
+
+// checkpoint constants
+#define CHECKPOINT_MAGIC        "C8CK"
+#define CHECKPOINT_VERSION      1
+#define CHECKPOINT_ARGS_SIZE    4096
+#define CHECKPOINT_MAX_ARGS     256
+#define CHECKPOINT_DEFAULT_SECONDS 60
+#define CHECKPOINT_CHECK_FRAMES 1024    // headless frames between looks at the clock
+
+// draw stream constants
+#define DRAW_MAGIC              "C8DS"
+#define DRAW_VERSION            1
+#define DRAW_DEFAULT_KEYFRAMES  300     // frames between keyframes for late joiners
+#define DRAW_COLLISION          0x80    // in the height byte of a sprite
+#define DRAW_BUFFER_SIZE        (DISPLAY_SIZE + 3 + 16)  // past a keyframe's size the frame is sent as one
+
+// launcher constants
+#define LAUNCHER_MAX_ROMS       16
+#define LAUNCHER_KEYPAD_MASK    0xFFFF  // what the roms see, without ESC and TAB
+#define REVERSE_VIDEO           ESC"[7m"
+#define RESET_ATTRIBUTES        ESC"[0m"
+
+// log constants
+#define LOG_RING_SIZE           (1 << 16)   // messages, the emulation thread waits while it is full
+#define LOG_MAX_ARGS            6
+#define LOG_RELEASE_BATCH       1024
+#define LOG_LINE_SIZE           256
+#define LOG_FILE_BUFFER_SIZE    (1 << 20)
+
+// input search constants
+#define SEARCH_ACTIONS          17      // no key or one of the 16 keys
+#define SEARCH_MAX_WORKERS      16
+#define SEARCH_FRONTIER         512     // savestates queued per worker
+#define SEARCH_MAX_NODES        (1 << 21)
+#define SEARCH_SEEN_SIZE        (1 << 22)
+#define SEARCH_MAX_EXPR         64
+#define SEARCH_DEFAULT_NODES    20000
+#define SEARCH_DEFAULT_DEPTH    600
+#define SEARCH_DEFAULT_HOLD     4
+
+// block IR constants, locations are v0-vF and the index register
+#define IR_LOC_I                16
+#define IR_LOC_COUNT            17
+#define IR_LOC_ALL              ((1u << IR_LOC_COUNT) - 1)
+#define IR_LOC(loc)             (1u << (loc))
+
 #define STRMATCH(flag_str)      (!strncmp(flag_str, arg, sizeof(flag_str)))
 
 static uint8_t FONT_DATA[] = {
@@ -80,14 +194,660 @@ static uint8_t FONT_DATA[] = {
 // Original COSMAC VIP incremented the index register on load/store operations
 #define QUIRK_INC_INDEX         (1 << 2)
 
+// Original COSMAC VIP waited for the vertical blank on every sprite draw, so
+// DXYN is the last instruction of a frame
+#define QUIRK_DISPLAY_WAIT      (1 << 3)
+
+// coverage export constants
+#define COVERAGE_BITMAP_SIZE    (MEM_SIZE / BYTE_SIZE)
+#define COVERAGE_IMAGE_WIDTH    64
+#define COVERAGE_IMAGE_SCALE    8
+
+// heatmap panel constants
+#define HEATMAP_WIDTH           64
+#define HEATMAP_REFRESH_FRAMES  6
+#define HEATMAP_DECAY_SHIFT     1
+#define HEATMAP_GAP_TEXT        "  "
+#define HALF_BLOCK_TEXT         "\xe2\x96\x80"
+#define HEATMAP_CELL_FORMAT     ESC"[38;2;%u;%u;%um"ESC"[48;2;%u;%u;%um"HALF_BLOCK_TEXT
+#define HEATMAP_CELL_LEN        (sizeof(HEATMAP_CELL_FORMAT) + 6 * 3)
+#define HEATMAP_LINE_SIZE       (HEATMAP_WIDTH * HEATMAP_CELL_LEN + sizeof(HEATMAP_GAP_TEXT))
+
+typedef enum {
+    ENGINE_INTERP,
+    ENGINE_PREDECODE,
+    ENGINE_TIERED,
+} EngineKind;
+
 typedef struct {
     uint32_t     instructions_per_frame;
     uint32_t     frames_per_sec;
     uint32_t     quirks;
+    uint32_t     headless_frames;
+    uint32_t     heatmap;
+    uint32_t     print_stats;
+    uint32_t     diffcheck;
+    uint32_t     runahead;
+    uint32_t     netplay_port;
+    uint32_t     governor_min_ips;
+    uint32_t     print_latency;
+    uint32_t     instances;
+    uint32_t     huge_pages;
+    uint32_t     checkpoint_seconds;
+    uint32_t     draw_keyframes;
+    uint32_t     latency_dump_frames;
+    uint32_t     search_nodes;
+    uint32_t     search_depth;
+    uint32_t     search_hold;
+    uint32_t     search_keys;
+    EngineKind   engine;
+    uint32_t     engine_given;
+    const char  *netplay_peer;
+    const char  *memsearch_path;
+    const char  *archive_path;
+    const char  *trace_path;
+    const char  *log_path;
+    const char  *checkpoint_path;
+    const char  *draw_path;
+    const char  *state_path;
+    const char  *coverage_path;
+    const char  *tcache_dir;
     const char   fg_text[ANSI_COLOR_FORMAT_LEN];
     const char   bg_text[ANSI_COLOR_FORMAT_LEN];
 } Config;
 
+// Filled only by the profiled dispatch variant.
+// One bit per memory address: fetched as an instruction / read as data (sprites, FX65)
+// and decaying access counters per address for the heatmap panel
+typedef struct {
+    uint8_t    executed[COVERAGE_BITMAP_SIZE];
+    uint8_t    read[COVERAGE_BITMAP_SIZE];
+    uint32_t   heat_exec[MEM_SIZE];
+    uint32_t   heat_read[MEM_SIZE];
+    uint32_t   heat_write[MEM_SIZE];
+    uint32_t   heat_frame;
+    char       panel[DISPLAY_HEIGHT][HEATMAP_LINE_SIZE];
+    uint32_t   panel_len[DISPLAY_HEIGHT];
+} Profile;
+
+// Superinstructions replace a recurring sequence of opcodes with one dispatch
+typedef enum {
+    EXEC_UNDECODED = 0,
+    EXEC_SINGLE,            // any instruction, executed by chip8_decode_execute
+    EXEC_LD_LD_DRAW,        // 6XNN; 6YNN; DXYN
+    EXEC_LD_I_DRAW,         // ANNN; DXYN
+    EXEC_ADD_SKIP_JUMP,     // 7XNN; 3XNN; 1NNN
+    EXEC_TIMER_SKIP_JUMP,   // FX07; 3XNN; 1NNN
+    EXEC_ALU_FLAG,          // 8XY4, 8XY5, 8XY7, 8XY6, 8XYE with a lazily computed VF
+} ExecKind;
+
+typedef struct {
+    uint8_t    kind;
+    uint8_t    len;
+    uint8_t    vf;          // reads or writes VF, so a pending flag must be stored first
+    uint16_t   raw[MAX_FUSED_LEN];
+} DecodedOp;
+
+// VF result of the last flag setting ALU op, computed only once something can observe it
+typedef struct {
+    uint8_t    op;          // N of the 8XYN instruction, 0 when nothing is pending
+    uint8_t    a;           // VX before the operation
+    uint8_t    b;           // VY before the operation
+} PendingFlag;
+
+// Decoded instructions indexed by the address they start at. A jump into the
+// middle of a fused sequence simply lands on that address's own entry
+typedef struct {
+    DecodedOp  ops[MEM_SIZE];
+    uint32_t   hits[MEM_SIZE];      // only counted for a translation cache to pick its hot blocks
+    uint32_t   count_hits;
+    uint16_t   hot_blocks[TCACHE_HOT_BLOCKS];
+    uint32_t   hot_count;
+} Predecode;
+
+// On-disk layout of the translation cache, one file per rom hash and quirk mask.
+// Entries are only trusted when the rom bytes and each entry's words match the loaded rom
+typedef struct {
+    char       magic[4];
+    uint32_t   version;
+    uint64_t   rom_hash;
+    uint32_t   quirks;
+    uint32_t   rom_size;
+    uint32_t   hot_count;
+    uint16_t   hot_blocks[TCACHE_HOT_BLOCKS];
+    uint8_t    rom[MAX_ROM_SIZE];
+    DecodedOp  ops[MAX_ROM_SIZE];
+} TranslationCacheFile;
+
+// An appliance build that always runs one rom compiles it in. A header made by
+// "chip8 --embed <rom> <header>" and built with -DEMBED_ROM='"<header>"' holds
+// the initial memory image and the decoded instructions of the rom, so neither
+// the rom file nor the decoder is needed at startup
+#ifdef EMBED_ROM
+#include EMBED_ROM
+#endif
+
+typedef enum {
+    IR_EXEC,                // run a predecoded entry as is
+    IR_SET_V,               // v[x] = imm
+    IR_ADD_V,               // v[x] += imm
+    IR_SET_I,               // i = imm
+    IR_SET_I_ADD_V,         // ANNN; FX1E: i = imm + v[x], VF = i > MEM_SIZE unless the flag is dead
+} IrKind;
+
+typedef struct {
+    DecodedOp  op;          // IR_EXEC only
+    uint8_t    kind;
+    uint8_t    x;
+    uint8_t    vf;          // same meaning as DecodedOp.vf
+    uint8_t    dead_vf;
+    uint8_t    retired;     // instructions accounted for, eliminated ones included
+    uint8_t    eliminated;
+    uint8_t    span;        // budget needed to reach the next consistent boundary, 0 inside a span
+    uint16_t   addr;
+    uint16_t   next;
+    uint16_t   imm;
+} IrOp;
+
+// A hot basic block translated and optimized by the compiler thread. Only valid
+// while the write generations of the pages its code was copied from are unchanged
+typedef struct {
+    IrOp       ops[TIER_MAX_BLOCK_LEN];
+    uint32_t   len;
+    uint16_t   addr;
+    uint16_t   first_page;
+    uint32_t   page_gen[2];
+} CompiledBlock;
+
+typedef struct {
+    uint16_t   addr;
+    uint16_t   first_page;
+    uint32_t   page_gen[2];
+    uint32_t   display_wait;    // end the block at DXYN so the batch can stop right after it
+    uint8_t    bytes[TIER_WINDOW_SIZE];
+} CompileRequest;
+
+// Tier 0 is chip8_decode_execute with per block entry counters. Hot blocks are
+// copied into a single producer/single consumer queue, translated on a background
+// thread and published into blocks[] without the emulation thread ever waiting.
+// Invalidated blocks go back to the compiler through the freed ring, the emulation
+// thread only does that after unpublishing them and it is the only one running blocks
+typedef struct {
+    CompiledBlock   *blocks[MEM_SIZE];          // published by the compiler thread
+    uint16_t         block_hits[MEM_SIZE];
+    uint8_t          requested[MEM_SIZE];
+    uint32_t         page_gen[TIER_PAGE_COUNT];
+    CompileRequest   queue[TIER_QUEUE_SIZE];
+    uint32_t         queue_head;                // written by the emulation thread
+    uint32_t         queue_tail;                // written by the compiler thread
+    CompiledBlock    pool[TIER_MAX_BLOCKS];
+    uint32_t         pool_used;                 // compiler thread only
+    CompiledBlock   *freed[TIER_MAX_BLOCKS];
+    uint32_t         freed_head;                // written by the emulation thread
+    uint32_t         freed_tail;                // written by the compiler thread
+    uint32_t         compiled;
+    uint32_t         dropped;                   // requests that found the pool full
+    uint32_t         running;
+    PlatformThread   thread;
+} Tiered;
+
+typedef struct {
+    uint64_t   frames;
+    uint64_t   instructions;
+    uint64_t   dispatches;
+    uint64_t   block_runs;
+    uint64_t   block_invalidations;
+    uint64_t   ir_eliminated;
+    uint64_t   batch_ns_total;
+    uint64_t   batch_ns_max;
+    uint64_t   runahead_frames;
+    uint64_t   runahead_ns_total;
+    uint64_t   rollbacks;
+    uint64_t   rollback_frames;
+    uint64_t   rollback_ns_max;
+    uint64_t   switches;
+    uint64_t   switch_ns_max;
+    uint64_t   netplay_stalls;
+    uint64_t   governed_frames;
+    uint64_t   governed_budget_total;
+    uint64_t   idle_frames;
+    uint64_t   main_start_ns;
+    uint64_t   startup_ns;          // from main to the end of the first frame
+    uint64_t   startup_cpu_ns;      // process CPU time at the end of the first frame
+    uint64_t   checkpoints;
+    uint64_t   checkpoint_ns_total;
+} Stats;
+
+static Stats stats = {0};
+
+typedef enum {
+    TRACE_FRAME,
+    TRACE_BATCH,
+    TRACE_TIMERS,
+    TRACE_RUNAHEAD,
+    TRACE_DISPLAY_BUILD,
+    TRACE_CONSOLE_WRITE,
+    TRACE_INPUT_POLL,
+    TRACE_PAUSED,
+    TRACE_SLEEP,
+    TRACE_COMPILE,
+} TracePhase;
+
+static const char *const TRACE_PHASE_NAMES[] = {
+    [TRACE_FRAME]           = "frame",
+    [TRACE_BATCH]           = "instruction batch",
+    [TRACE_TIMERS]          = "timer update",
+    [TRACE_RUNAHEAD]        = "runahead",
+    [TRACE_DISPLAY_BUILD]   = "display build",
+    [TRACE_CONSOLE_WRITE]   = "console write",
+    [TRACE_INPUT_POLL]      = "input poll",
+    [TRACE_PAUSED]          = "paused",
+    [TRACE_SLEEP]           = "sleep",
+    [TRACE_COMPILE]         = "compile block",
+};
+
+typedef struct {
+    uint64_t   start_ns;
+    uint64_t   end_ns;
+    uint32_t   phase;
+} TraceEvent;
+
+// Only ever written by its own thread, so recording takes no locks
+typedef struct {
+    const char  *name;
+    uint32_t     count;
+    uint32_t     dropped;
+    TraceEvent   events[TRACE_MAX_EVENTS];
+} TraceBuffer;
+
+// NULL unless -trace-timeline is given
+static TraceBuffer *trace_main = NULL;
+static TraceBuffer *trace_compiler = NULL;
+
+static inline
+uint64_t trace_begin(const TraceBuffer *t) {
+    return t ? platform_time_ns() : 0;
+}
+
+static inline
+void trace_end(TraceBuffer *t, TracePhase phase, uint64_t start_ns) {
+    if (!t)
+        return;
+
+    if (t->count == TRACE_MAX_EVENTS) {
+        t->dropped++;
+        return;
+    }
+    t->events[t->count++] = (TraceEvent) { .start_ns = start_ns, .end_ns = platform_time_ns(), .phase = phase };
+}
+
+typedef enum {
+    LATENCY_FRAME_PERIOD,
+    LATENCY_BATCH,
+    LATENCY_DISPLAY_BUILD,
+    LATENCY_CONSOLE_WRITE,
+    LATENCY_SLEEP_OVERSHOOT,
+    LATENCY_PHASE_COUNT,
+} LatencyPhase;
+
+static const char *const LATENCY_PHASE_NAMES[] = {
+    [LATENCY_FRAME_PERIOD]      = "frame period",
+    [LATENCY_BATCH]             = "batch",
+    [LATENCY_DISPLAY_BUILD]     = "display build",
+    [LATENCY_CONSOLE_WRITE]     = "console write",
+    [LATENCY_SLEEP_OVERSHOOT]   = "sleep overshoot",
+};
+
+// Log bucketed like an HDR histogram: exact below LATENCY_SUB_COUNT ns, then
+// LATENCY_SUB_COUNT linear buckets for every power of two. Always recorded
+typedef struct {
+    uint32_t   counts[LATENCY_BUCKETS];
+    uint64_t   count;
+    uint64_t   max;
+} Histogram;
+
+static Histogram latency[LATENCY_PHASE_COUNT];
+
+static inline
+uint32_t histogram_bucket(uint64_t value) {
+    if (value < LATENCY_SUB_COUNT)
+        return value;
+
+    value = value >> LATENCY_MAX_BITS ? (1ULL << LATENCY_MAX_BITS) - 1 : value;
+    const uint32_t shift = platform_highest_bit_u64(value) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_COUNT + (uint32_t)(value >> shift) - LATENCY_SUB_COUNT;
+}
+
+// highest value that falls into the bucket
+static inline
+uint64_t histogram_bucket_value(uint32_t bucket) {
+    if (bucket < LATENCY_SUB_COUNT)
+        return bucket;
+
+    const uint32_t shift = bucket / LATENCY_SUB_COUNT - 1;
+    const uint64_t sub = bucket % LATENCY_SUB_COUNT + LATENCY_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline
+void latency_record(LatencyPhase phase, uint64_t ns) {
+    Histogram *h = &latency[phase];
+    h->counts[histogram_bucket(ns)]++;
+    h->count++;
+    h->max = ns > h->max ? ns : h->max;
+}
+
+// Prints the percentiles of h, or of what was recorded into h after the copy
+// in since. The max of an interval is only known to bucket precision
+static inline
+void histogram_print(FILE *out, const char *name, const Histogram *h, const Histogram *since) {
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+    const uint64_t count = h->count - (since ? since->count : 0);
+
+    fprintf(out, "%-16s %10llu", name, (unsigned long long)count);
+    if (!count) {
+        fprintf(out, "\n");
+        return;
+    }
+
+    uint64_t seen = 0;
+    uint32_t bucket = 0;
+    uint32_t last = 0;
+    for (uint32_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); ++p) {
+        const uint64_t rank = (uint64_t)(percentiles[p] / 100.0 * count + 0.999999);
+        for (; seen < rank; ++bucket) {
+            const uint32_t n = h->counts[bucket] - (since ? since->counts[bucket] : 0);
+            seen += n;
+            last = n ? bucket : last;
+        }
+        fprintf(out, " %10.2f", histogram_bucket_value(last) / 1000.0);
+    }
+
+    uint64_t max = h->max;
+    if (since) {
+        for (bucket = LATENCY_BUCKETS; bucket-- > 0 && h->counts[bucket] == since->counts[bucket];)
+            ;
+        max = histogram_bucket_value(bucket);
+    }
+    fprintf(out, " %10.2f\n", max / 1000.0);
+}
+
+static inline
+void latency_print(FILE *out, const Histogram *since) {
+    fprintf(out, "%-16s %10s %10s %10s %10s %10s %10s\n",
+            "latency (us)", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (uint32_t p = 0; p < LATENCY_PHASE_COUNT; ++p)
+        histogram_print(out, LATENCY_PHASE_NAMES[p], &latency[p], since ? &since[p] : NULL);
+}
+
+// Reports to stderr what was recorded since the previous dump
+static inline
+void latency_dump(void) {
+    static Histogram last[LATENCY_PHASE_COUNT];
+    latency_print(stderr, last);
+    memcpy(last, latency, sizeof(latency));
+}
+
+// Called at the start of every frame, returns the start time
+static inline
+uint64_t latency_frame_start(void) {
+    static uint64_t previous = 0;
+    const uint64_t now = platform_time_ns();
+    if (previous)
+        latency_record(LATENCY_FRAME_PERIOD, now - previous);
+    previous = now;
+    return now;
+}
+
+typedef enum {
+    LOG_OFF,
+    LOG_INFO,
+    LOG_DEBUG,
+} LogLevel;
+
+#ifdef DEBUG_LOG
+static LogLevel log_level = LOG_DEBUG;
+#else
+static LogLevel log_level = LOG_OFF;
+#endif
+
+typedef struct {
+    const char  *format;
+    uint32_t     arg_count;
+    uint64_t     args[LOG_MAX_ARGS];
+} LogMessage;
+
+// Single producer/single consumer ring like the tiered compile queue. The
+// emulation thread is the only producer, the log thread formats and writes
+typedef struct {
+    LogMessage       ring[LOG_RING_SIZE];
+    uint32_t         head;                      // written by the emulation thread
+    uint32_t         tail;                      // written by the log thread
+    uint32_t         cached_tail;               // emulation thread only
+    uint32_t         running;
+    FILE            *file;
+    PlatformThread   thread;
+} Logger;
+
+// NULL while no log thread runs, messages are then discarded
+static Logger *logger = NULL;
+
+static inline
+void log_push(const char *format, const uint64_t *args, uint32_t arg_count) {
+    Logger *l = logger;
+    if (!l)
+        return;
+
+    const uint32_t head = l->head;
+    while (head - l->cached_tail == LOG_RING_SIZE) {
+        l->cached_tail = platform_atomic_load_u32(&l->tail);
+        if (head - l->cached_tail == LOG_RING_SIZE)
+            platform_sleep(1);
+    }
+
+    LogMessage *m = &l->ring[head % LOG_RING_SIZE];
+    m->format = format;
+    m->arg_count = arg_count < LOG_MAX_ARGS ? arg_count : LOG_MAX_ARGS;
+    for (uint32_t a = 0; a < m->arg_count; ++a)
+        m->args[a] = args[a];
+    platform_atomic_store_u32(&l->head, head + 1);
+}
+
+// Formats one conversion at a time with the type its length modifier and
+// conversion character ask for, the arguments were all widened to 64 bits
+static inline
+uint32_t log_format(char *out, uint32_t size, const LogMessage *m) {
+    uint32_t len = 0;
+    uint32_t arg = 0;
+    const char *f = m->format;
+
+    while (*f && len < size - 1) {
+        if (*f != '%' || f[1] == '%') {
+            out[len++] = *f;
+            f += *f == '%' ? 2 : 1;
+            continue;
+        }
+
+        // copy the flags, width and precision, drop the length modifier
+        char spec[16] = "%";
+        uint32_t spec_len = 1;
+        for (++f; *f && strchr("-+ #0123456789.", *f) && spec_len < sizeof(spec) - 4; ++f)
+            spec[spec_len++] = *f;
+        while (*f && strchr("hlzjt", *f))
+            ++f;
+        if (!*f)
+            break;
+
+        const char conversion = *f++;
+        const uint64_t value = arg < m->arg_count ? m->args[arg++] : 0;
+
+        // plain %u and %x make up nearly all of the instruction log
+        if (spec_len == 1 && (conversion == 'u' || conversion == 'x') && size - len > 20) {
+            const uint32_t base = conversion == 'u' ? 10 : 16;
+            char digits[20];
+            uint32_t count = 0;
+            uint64_t rest = value;
+            do {
+                digits[count++] = "0123456789abcdef"[rest % base];
+                rest /= base;
+            } while (rest);
+            while (count)
+                out[len++] = digits[--count];
+            continue;
+        }
+
+        int written;
+        if (conversion == 's' || conversion == 'c' || conversion == 'p') {
+            spec[spec_len++] = conversion;
+            written = conversion == 's' ? snprintf(&out[len], size - len, spec, (const char *)(uintptr_t)value) :
+                      conversion == 'c' ? snprintf(&out[len], size - len, spec, (int)value) :
+                                          snprintf(&out[len], size - len, spec, (void *)(uintptr_t)value);
+        } else {
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = conversion;
+            written = conversion == 'd' || conversion == 'i' ?
+                snprintf(&out[len], size - len, spec, (long long)value) :
+                snprintf(&out[len], size - len, spec, (unsigned long long)value);
+        }
+        len += written < 0 ? 0 : (uint32_t)written;
+        len = len < size - 1 ? len : size - 1;
+    }
+
+    out[len++] = '\n';
+    return len;
+}
+
+static inline
+void log_drain(Logger *l) {
+    char line[LOG_LINE_SIZE + 1];
+    const uint32_t head = platform_atomic_load_u32(&l->head);
+
+    // hands slots back in batches so a waiting emulation thread resumes early
+    for (uint32_t tail = l->tail; tail != head;) {
+        const uint32_t len = log_format(line, LOG_LINE_SIZE, &l->ring[tail % LOG_RING_SIZE]);
+        fwrite(line, 1, len, l->file);
+        if (++tail % LOG_RELEASE_BATCH == 0 || tail == head)
+            platform_atomic_store_u32(&l->tail, tail);
+    }
+}
+
+THREAD_FUNC(log_thread) {
+    Logger *l = arg;
+
+    while (platform_atomic_load_u32(&l->running)) {
+        if (l->tail == platform_atomic_load_u32(&l->head)) {
+            fflush(l->file);
+            platform_sleep(1);
+            continue;
+        }
+        log_drain(l);
+    }
+    log_drain(l);
+    fflush(l->file);
+
+    THREAD_RETURN;
+}
+
+static inline
+void log_start(const char *path) {
+    // the ring is only mapped when something logs
+    ArenaPages pages;
+    Logger *l = platform_map_arena(sizeof(Logger), 0, &pages);
+    if (!l)
+        FATAL("Failed to map the log ring");
+
+    l->file = path ? fopen(path, "w") : stderr;
+    if (!l->file)
+        FATAL("Failed to open log file: %s", path);
+    if (path)
+        setvbuf(l->file, NULL, _IOFBF, LOG_FILE_BUFFER_SIZE);
+
+    l->running = 1;
+    if (!platform_thread_start(&l->thread, log_thread, l))
+        FATAL("Failed to start log thread");
+    logger = l;
+}
+
+// registered with atexit so messages before a FATAL are written too
+static inline
+void log_stop(void) {
+    Logger *l = logger;
+    if (!l)
+        return;
+
+    logger = NULL;
+    platform_atomic_store_u32(&l->running, 0);
+    platform_thread_join(l->thread);
+    if (l->file != stderr)
+        fclose(l->file);
+    platform_unmap_arena(l, sizeof(Logger));
+}
+
+typedef struct {
+    uint32_t   frame;
+    KeyStates  keys;
+} KeyChange;
+
+// Every field is a 32 bit word sent in network byte order. Carries the sender's
+// input for frames [base_frame, frame_count) as the changes after base_keys
+typedef struct {
+    uint32_t   magic;
+    uint32_t   frame_count;     // sender's input is known for all frames below this
+    uint32_t   ack;             // receiver's frames the sender has input for
+    uint32_t   base_frame;
+    KeyStates  base_keys;
+    uint32_t   change_count;
+    KeyChange  changes[NETPLAY_MAX_CHANGES];
+} NetplayPacket;
+
+// state at the last FX07, reading the timer again with nothing changed is a polling loop
+typedef struct {
+    uint16_t   pc;
+    uint16_t   i;
+    uint8_t    v[REG_COUNT];
+    uint32_t   writes;
+    uint32_t   rng;
+} TimerPoll;
+
+// Every frame of a draw stream is its clears and sprites, then a keyframe when
+// one is due, then DRAW_END_FRAME. A RESYNC takes the place of the commands
+// when they would not rebuild the display, so receivers that joined at any
+// keyframe or resync stay exact
+typedef enum {
+    DRAW_END_FRAME,
+    DRAW_CLEAR,
+    DRAW_SPRITE,        // x, y, height | DRAW_COLLISION, then height bytes; clipped at the bottom
+    DRAW_KEYFRAME,      // DISPLAY_SIZE bytes the display already matches
+    DRAW_RESYNC,        // DISPLAY_SIZE bytes the display is set to
+} DrawCommand;
+
+typedef struct {
+    char       magic[4];
+    uint32_t   version;
+    uint32_t   width;           // pixels
+    uint32_t   height;
+    uint32_t   frames_per_sec;
+} DrawStreamHeader;
+
+typedef struct {
+    FILE      *file;
+    const char *path;
+    int        live;            // flushed every frame for spectators
+    uint32_t   keyframe_frames;
+    uint32_t   since_keyframe;
+    uint8_t    commands[DRAW_BUFFER_SIZE];     // of the current frame
+    uint32_t   length;
+    uint8_t    overflow;
+    uint8_t    shadow[DISPLAY_SIZE];           // the display of a receiver of all frames so far
+    uint64_t   frames;
+    uint64_t   sprites;
+    uint64_t   clears;
+    uint64_t   keyframes;
+    uint64_t   resyncs;
+    uint64_t   bytes;
+} DrawStream;
+
 typedef struct {
     uint8_t    mem[MEM_SIZE];
     uint16_t   pc;
@@ -98,17 +858,53 @@ typedef struct {
     uint8_t    sound_timer;
     uint8_t    v[REG_COUNT];
     uint8_t    display[DISPLAY_SIZE];
+    uint32_t   rng;
     KeyStates  keys;
+    KeyStates  key_wait;        // keys held while FX0A waits for a release
+    uint8_t    drawn;           // set by DXYN, ends the batch under QUIRK_DISPLAY_WAIT
+    uint8_t    idle;            // spun on the delay timer, a key or a jump to itself
+    uint32_t   writes;          // display and memory writes, a loop that makes any is not idle
+    TimerPoll  poll;
     Config     config;
+    Profile   *profile;
+    Predecode *predecode;
+    Tiered    *tiered;
+    DrawStream *draws;
 } Chip8;
 
+static inline
+void profile_mark(uint8_t *bitmap, uint32_t *heat, uint32_t addr, uint32_t len) {
+    for (uint32_t a = addr; a < addr + len; ++a) {
+        const uint32_t wrapped = a % MEM_SIZE;
+        if (bitmap)
+            bitmap[wrapped / BYTE_SIZE] |= 1 << (wrapped % BYTE_SIZE);
+        heat[wrapped]++;
+    }
+}
+
+// instrumentation hooks, constant folded away in the normal dispatch variant
+#define PROFILE_EXEC(c, addr)           if (profiled) profile_mark((c)->profile->executed, (c)->profile->heat_exec, addr, 2)
+#define PROFILE_READ(c, addr, len)      if (profiled) profile_mark((c)->profile->read, (c)->profile->heat_read, addr, len)
+#define PROFILE_WRITE(c, addr, len)     if (profiled) profile_mark(NULL, (c)->profile->heat_write, addr, len)
+
 static inline
 void chip8_load_to_mem(Chip8 *c, uint32_t offset, void *data, size_t size) {
     memcpy(&c->mem[offset], data, size);
 }
 
+#ifdef EMBED_ROM
+// memory is the whole image, font included
+static inline
+size_t chip8_load_embedded(Chip8 *c) {
+    printf("Embedded rom: %s\n", EMBEDDED_ROM_NAME);
+    memcpy(c->mem, EMBEDDED_MEM, MEM_SIZE);
+    c->pc = PROGRAM_START_OFFSET;
+    return EMBEDDED_ROM_SIZE;
+}
+#endif
+
 static inline
-void chip8_load_rom(Chip8 *c, const char *file_path) {
+size_t chip8_load_rom(Chip8 *c, const char *file_path) {
     printf("Loading rom: %s\n", file_path);
     FILE *file = fopen(file_path, "rb");
     if (!file)
@@ -128,17 +924,19 @@ void chip8_load_rom(Chip8 *c, const char *file_path) {
     fread(&c->mem[c->pc], sizeof(char), file_size, file);
 
     fclose(file);
+    return file_size;
 }
 
 
 static inline
-uint16_t chip8_fetch(Chip8 *c) {
+uint16_t chip8_fetch_variant(Chip8 *c, const int profiled) {
     if (c->pc + 2 > MEM_SIZE) {
         DEBUG("Reached end of memory: %u", c->pc);
         platform_revert();
         exit(1);
     }
 
+    PROFILE_EXEC(c, c->pc);
     uint16_t instruction = c->mem[c->pc] << BYTE_SIZE | c->mem[c->pc+1];
     c->pc += 2;
     DEBUG("instruction: %04x", instruction);
@@ -146,17 +944,56 @@ uint16_t chip8_fetch(Chip8 *c) {
 }
 
 static inline
-void chip8_clear_screen(Chip8 *c) {
-    memset(c->display, 0, DISPLAY_SIZE);
+uint16_t chip8_fetch(Chip8 *c) {
+    return chip8_fetch_variant(c, 0);
 }
 
+// xorshift32, kept per instance so runs are reproducible
 static inline
-void chip8_load_pixels(Chip8 *c, uint8_t x, uint8_t y, uint8_t h) {
+uint8_t chip8_rand(Chip8 *c) {
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 17;
+    c->rng ^= c->rng << 5;
+    return c->rng;
+}
 
-    x %= DISPLAY_WIDTH * BYTE_SIZE;
-    y %= DISPLAY_HEIGHT;
+// addr is the FX07 instruction, only the governor resets poll and idle. It is
+// called from the idle_probes variants alone, like 1NNN and FX0A setting idle
+static inline
+void chip8_note_timer_read(Chip8 *c, uint16_t addr) {
+    c->idle |= c->poll.pc == addr && c->poll.i == c->i && c->poll.writes == c->writes &&
+        c->poll.rng == c->rng && !memcmp(c->poll.v, c->v, REG_COUNT);
+    c->poll.pc = addr;
+    c->poll.i = c->i;
+    c->poll.writes = c->writes;
+    c->poll.rng = c->rng;
+    memcpy(c->poll.v, c->v, REG_COUNT);
+}
 
-    const uint8_t *src = &c->mem[c->i];
+static inline
+void draw_record(DrawStream *d, const uint8_t *bytes, uint32_t count) {
+    if (d->length + count > DRAW_BUFFER_SIZE) {
+        d->overflow = 1;
+        return;
+    }
+    memcpy(&d->commands[d->length], bytes, count);
+    d->length += count;
+}
+
+static inline
+void chip8_clear_screen(Chip8 *c) {
+    memset(c->display, 0, DISPLAY_SIZE);
+    c->writes++;
+    if (c->draws) {
+        draw_record(c->draws, (const uint8_t[]) { DRAW_CLEAR }, 1);
+        c->draws->clears++;
+    }
+}
+
+// XORs h rows at x, y and returns the collision flag, the receiving end of a
+// draw stream uses it too
+static inline
+uint8_t display_draw_sprite(uint8_t *display, uint8_t x, uint8_t y, const uint8_t *src, uint8_t h) {
 
     const uint8_t start_bit = x % BYTE_SIZE;
     const uint8_t rhs_bits = BYTE_SIZE - start_bit;
@@ -172,30 +1009,49 @@ void chip8_load_pixels(Chip8 *c, uint8_t x, uint8_t y, uint8_t h) {
         if (idx >= DISPLAY_SIZE)
             break;
 
-        vf = vf || (c->display[idx] & first_byte_mask);
+        vf = vf || (display[idx] & first_byte_mask);
 
-        c->display[idx] ^= first_byte_mask;
+        display[idx] ^= first_byte_mask;
 
         const uint8_t second_byte_mask = (sprite_row & (0xFF >> rhs_bits)) << rhs_bits;
 
         const uint32_t not_offscreen = (idx+1) % DISPLAY_WIDTH;
 
         vf = not_offscreen ?
-            vf || (c->display[idx+1] & second_byte_mask) :
+            vf || (display[idx+1] & second_byte_mask) :
             vf;
 
-        c->display[idx+1] ^= not_offscreen ?
+        display[idx+1] ^= not_offscreen ?
             second_byte_mask :
             0;
     }
 
-    c->v[0xF] = vf;
+    return vf;
+}
+
+static inline
+void chip8_load_pixels(Chip8 *c, uint8_t x, uint8_t y, uint8_t h) {
+
+    x %= DISPLAY_WIDTH * BYTE_SIZE;
+    y %= DISPLAY_HEIGHT;
+
+    const uint8_t *src = &c->mem[c->i];
+    c->v[0xF] = display_draw_sprite(c->display, x, y, src, h);
+    c->drawn = 1;
+    c->writes++;
 
+    if (c->draws) {
+        const uint8_t rows = h < DISPLAY_HEIGHT - y ? h : DISPLAY_HEIGHT - y;
+        draw_record(c->draws, (const uint8_t[]) { DRAW_SPRITE, x, y, rows | (c->v[0xF] ? DRAW_COLLISION : 0) }, 4);
+        draw_record(c->draws, src, rows);
+        c->draws->sprites++;
+    }
 }
 
 
 static inline
 void chip8_display(Chip8 *c) {
+    const uint64_t build_start = platform_time_ns();
     char frame_buffer[MAX_FRAME_BUFFER_SIZE];
     size_t char_count = 0;
     for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
@@ -212,13 +1068,68 @@ void chip8_display(Chip8 *c) {
                     byte & (1 << 0) ? c->config.fg_text : c->config.bg_text
                     );
         }
+        if (c->config.heatmap) {
+            memcpy(&frame_buffer[char_count], c->profile->panel[y], c->profile->panel_len[y]);
+            char_count += c->profile->panel_len[y];
+        }
         char_count += snprintf(&frame_buffer[char_count], MAX_FRAME_BUFFER_SIZE, SET_DEFAULT_BG PLATFORM_EOL);
     }
+    trace_end(trace_main, TRACE_DISPLAY_BUILD, build_start);
+
+    const uint64_t write_start = platform_time_ns();
+    latency_record(LATENCY_DISPLAY_BUILD, write_start - build_start);
     platform_write_to_console(frame_buffer, char_count, DISPLAY_HEIGHT);
+    latency_record(LATENCY_CONSOLE_WRITE, platform_time_ns() - write_start);
+    trace_end(trace_main, TRACE_CONSOLE_WRITE, write_start);
 }
 
 static inline
-void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
+uint32_t heatmap_max(const uint32_t *heat) {
+    uint32_t max = 1;
+    for (uint32_t i = 0; i < MEM_SIZE; ++i)
+        max = heat[i] > max ? heat[i] : max;
+    return max;
+}
+
+// Rebuilds the side panel every HEATMAP_REFRESH_FRAMES frames and decays the counters.
+// Writes are red, reads green and executes blue, each scaled by its channel maximum.
+// Every terminal line shows two rows of 64 addresses using half block characters
+static inline
+void heatmap_update(Profile *p) {
+    if (++p->heat_frame % HEATMAP_REFRESH_FRAMES)
+        return;
+
+    const uint32_t max_write = heatmap_max(p->heat_write);
+    const uint32_t max_read = heatmap_max(p->heat_read);
+    const uint32_t max_exec = heatmap_max(p->heat_exec);
+
+    for (uint32_t line = 0; line < DISPLAY_HEIGHT; ++line) {
+        char *out = p->panel[line];
+        uint32_t len = snprintf(out, HEATMAP_LINE_SIZE, SET_DEFAULT_BG HEATMAP_GAP_TEXT);
+
+        for (uint32_t x = 0; x < HEATMAP_WIDTH; ++x) {
+            const uint32_t top = (line * 2) * HEATMAP_WIDTH + x;
+            const uint32_t bottom = top + HEATMAP_WIDTH;
+            len += snprintf(&out[len], HEATMAP_LINE_SIZE - len, HEATMAP_CELL_FORMAT,
+                    (uint32_t)((uint64_t)p->heat_write[top] * 255 / max_write),
+                    (uint32_t)((uint64_t)p->heat_read[top] * 255 / max_read),
+                    (uint32_t)((uint64_t)p->heat_exec[top] * 255 / max_exec),
+                    (uint32_t)((uint64_t)p->heat_write[bottom] * 255 / max_write),
+                    (uint32_t)((uint64_t)p->heat_read[bottom] * 255 / max_read),
+                    (uint32_t)((uint64_t)p->heat_exec[bottom] * 255 / max_exec));
+        }
+        p->panel_len[line] = len;
+    }
+
+    for (uint32_t i = 0; i < MEM_SIZE; ++i) {
+        p->heat_write[i] -= p->heat_write[i] >> HEATMAP_DECAY_SHIFT;
+        p->heat_read[i] -= p->heat_read[i] >> HEATMAP_DECAY_SHIFT;
+        p->heat_exec[i] -= p->heat_exec[i] >> HEATMAP_DECAY_SHIFT;
+    }
+}
+
+static inline
+void chip8_decode_execute_variant(Chip8 *c, uint16_t instruction, const int profiled, const int idle_probes) {
     switch (OP(instruction)) {
         case 0x0: {
                       switch (NN(instruction)) {
@@ -239,6 +1150,8 @@ void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
         case 0x1: {
                       const uint16_t jmp_pos = NNN(instruction);
                       DEBUG("Jump to %u", jmp_pos);
+                      if (idle_probes)
+                          c->idle |= jmp_pos == c->pc - 2;
                       c->pc = jmp_pos;
                       break;
                   }
@@ -378,7 +1291,7 @@ void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
         case 0xC: {
                       const uint8_t reg = X(instruction);
                       const uint16_t val = NN(instruction);
-                      const uint8_t r = rand();
+                      const uint8_t r = chip8_rand(c);
                       c->v[reg] = r & val;
                       DEBUG("Rand v%u = %u & %u", reg, r, val);
                       break;
@@ -388,6 +1301,7 @@ void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
                       const uint8_t y = c->v[Y(instruction)];
                       const uint8_t h = N(instruction);
                       DEBUG("draw %u, %u, %u", x, y, h);
+                      PROFILE_READ(c, c->i, h);
                       chip8_load_pixels(c, x, y, h);
                       break;
                   }
@@ -411,26 +1325,29 @@ void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
                       case 0x0A:
                           {
                               DEBUG("Wait for key press and release");
-                              static KeyStates store = 0;
 
-                              if (store > c->keys) {
+                              if (c->key_wait > c->keys) {
                                   uint16_t k = 0;
 
-                                  const KeyStates diff = store ^ c->keys;
+                                  const KeyStates diff = c->key_wait ^ c->keys;
                                   while (k < CKEY_ESC && !KEY_DOWN(diff, k))
                                       k++;
 
-                                  DEBUG("Key pressed and released: %s\n", get_chip8key_name(k));
+                                  DEBUG("Key pressed and released: %s", LOG_STR(get_chip8key_name(k)));
                                   c->v[reg] = k;
-                                  store = 0;
+                                  c->key_wait = 0;
                               } else {
-                                  store = c->keys;
+                                  c->key_wait = c->keys;
                                   c->pc -= 2;
+                                  if (idle_probes)
+                                      c->idle = 1;
                               }
 
                               break;
                           }
                       case 0x07:
+                          if (idle_probes)
+                              chip8_note_timer_read(c, c->pc - 2);
                           c->v[reg] = c->delay_timer;
                           DEBUG("v%u = delay_timer (%u)", reg, c->delay_timer);
                           break;
@@ -457,21 +1374,26 @@ void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
                               const uint8_t d3 = d % 10;
                               const uint8_t d2 = (d /= 10) % 10;
                               const uint8_t d1 = (d /= 10);
+                              PROFILE_WRITE(c, c->i, 3);
                               c->mem[c->i] = d1;
                               c->mem[c->i + 1] = d2;
                               c->mem[c->i + 2] = d3;
+                              c->writes++;
                               DEBUG("d: %u -> (%u, %u, %u)", c->v[reg], d1, d2, d3);
                               break;
                           }
                       case 0x55:
+                          PROFILE_WRITE(c, c->i, reg + 1);
                           for (int i = 0; i <= reg; ++i) {
                               c->mem[c->i + i] = c->v[i];
                               DEBUG("Storing v%u (%u) at mem[%u]", i, c->v[i], i);
                           }
+                          c->writes++;
                           if (c->config.quirks & QUIRK_INC_INDEX)
                               c->i += reg + 1;
                           break;
                       case 0x65:
+                          PROFILE_READ(c, c->i, reg + 1);
                           for (int i = 0; i <= reg; ++i) {
                               c->v[i] = c->mem[c->i + i];
                               DEBUG("Loading v%u from mem[%u] (%u)", i, i, c->mem[i]);
@@ -481,44 +1403,3524 @@ void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
                       break;
                   }
         default:  {
-                      DEBUG("Unrecognized instruction: %04x", instruction);
+                      INFO("Unrecognized instruction %04x at %03x", instruction, c->pc - 2);
                   }
     }
 }
 
 static inline
-const char *usage(void) {
-    return
-        "Usage: chip8 <rom> [options]\n"
-        "Options:\n"
-        "    --help, -h             Display this information.\n"
-        "    -ips <arg>             Instructions per second to use, must be greater or equal to FPS (Default: " STRINGIFY(DEFAULT_IPS) ").\n"
-        "    -fps <arg>             Frames per second to use (Default: " STRINGIFY(DEFAULT_FPS) ").\n"
-        "    -qshift-use-vy         Quirk: set VY to VX before bit shifting operations.\n"
-        "    -qbxnn                 Quirk: use BXNN version of BNNN (Jump with offset) operation.\n"
-        "    -qinc-index            Quirk: increment index register on memory load/store operations.\n"
-        "    -fg <hexcode>          Set pixel 'on' color (foreground). Eg: FF0000 for red\n"
-        "    -bg <hexcode>          Set pixel 'off' color (background). Eg: 00FF00 for green\n"
-    ;
+void chip8_decode_execute(Chip8 *c, uint16_t instruction) {
+    chip8_decode_execute_variant(c, instruction, 0, 0);
 }
 
 static inline
-void generate_ansi_coded_text(int32_t color, const char *out_text, const char *default_text) {
-    char color_format_buffer[ANSI_COLOR_FORMAT_LEN];
-    size_t str_len = 0;
+uint16_t predecode_word(const uint8_t *mem, uint32_t addr) {
+    return addr + 2 <= MEM_SIZE ? mem[addr] << BYTE_SIZE | mem[addr+1] : 0;
+}
 
-    if (color != -1)
-        str_len = snprintf(color_format_buffer,
-                ANSI_COLOR_FORMAT_LEN,
-                ANSI_COLOR_FORMAT PIXEL_TEXT,
-                color >> 16 & 0xFF,
-                color >>  8 & 0xFF,
-                color >>  0 & 0xFF);
-    else
-        str_len = snprintf(color_format_buffer,
-                ANSI_COLOR_FORMAT_LEN,
-                default_text);
-    memcpy((char*)out_text, color_format_buffer, str_len);
+static inline
+int predecode_touches_vf(uint16_t w) {
+    switch (OP(w)) {
+    case 0x0: case 0x1: case 0x2: case 0xA:
+        return 0;
+    case 0xD:
+        return 1;
+    case 0x5: case 0x8: case 0x9:
+        return X(w) == 0xF || Y(w) == 0xF;
+    case 0xF:
+        return X(w) == 0xF || NN(w) == 0x1E;
+    default:
+        return X(w) == 0xF;
+    }
+}
+
+static inline
+int predecode_is_flag_alu(uint16_t w) {
+    return OP(w) == 0x8 &&
+        (N(w) == 0x4 || N(w) == 0x5 || N(w) == 0x7 || N(w) == 0x6 || N(w) == 0xE);
+}
+
+static inline
+void predecode_decode(const uint8_t *mem, DecodedOp *op, uint32_t addr) {
+    const uint16_t w0 = predecode_word(mem, addr);
+    const uint16_t w1 = predecode_word(mem, addr + 2);
+    const uint16_t w2 = predecode_word(mem, addr + 4);
+
+    *op = (DecodedOp) { .kind = EXEC_SINGLE, .len = 1, .raw = { w0, w1, w2 } };
+
+    if (predecode_is_flag_alu(w0)) {
+        op->kind = EXEC_ALU_FLAG;
+        op->vf = X(w0) == 0xF || Y(w0) == 0xF;
+        return;
+    }
+
+    if (OP(w0) == 0x6 && OP(w1) == 0x6 && OP(w2) == 0xD && addr + 6 <= MEM_SIZE)
+        op->kind = EXEC_LD_LD_DRAW, op->len = 3;
+
+    else if (OP(w0) == 0xA && OP(w1) == 0xD && addr + 4 <= MEM_SIZE)
+        op->kind = EXEC_LD_I_DRAW, op->len = 2;
+
+    else if (OP(w0) == 0x7 && OP(w1) == 0x3 && OP(w2) == 0x1 &&
+             X(w0) == X(w1) && addr + 6 <= MEM_SIZE)
+        op->kind = EXEC_ADD_SKIP_JUMP, op->len = 3;
+
+    else if (OP(w0) == 0xF && NN(w0) == 0x07 && OP(w1) == 0x3 && OP(w2) == 0x1 &&
+             X(w0) == X(w1) && addr + 6 <= MEM_SIZE)
+        op->kind = EXEC_TIMER_SKIP_JUMP, op->len = 3;
+
+    for (uint32_t i = 0; i < op->len; ++i)
+        op->vf |= predecode_touches_vf(op->raw[i]);
+}
+
+static inline
+void predecode_materialize_vf(Chip8 *c, PendingFlag *pending) {
+    switch (pending->op) {
+    case 0x4: c->v[0xF] = pending->a + pending->b > 0xFF;   break;
+    case 0x5: c->v[0xF] = pending->a >= pending->b;         break;
+    case 0x7: c->v[0xF] = pending->a <= pending->b;         break;
+    case 0x6: c->v[0xF] = pending->a & (1 << 0) ? 1 : 0;    break;
+    case 0xE: c->v[0xF] = pending->a & (1 << 7) ? 1 : 0;    break;
+    }
+    pending->op = 0;
+}
+
+// same results as the 8XYN cases of chip8_decode_execute, minus the VF store
+static inline
+void predecode_execute_flag_alu(Chip8 *c, PendingFlag *pending, uint16_t instruction) {
+    const uint8_t x = X(instruction);
+    const uint8_t y = Y(instruction);
+
+    if ((N(instruction) == 0x6 || N(instruction) == 0xE) && c->config.quirks & QUIRK_SHIFT_USE_VY)
+        c->v[x] = c->v[y];
+
+    *pending = (PendingFlag) { .op = N(instruction), .a = c->v[x], .b = c->v[y] };
+
+    switch (N(instruction)) {
+    case 0x4: c->v[x] += c->v[y];           break;
+    case 0x5: c->v[x] -= c->v[y];           break;
+    case 0x7: c->v[x] = c->v[y] - c->v[x];  break;
+    case 0x6: c->v[x] >>= 1;                break;
+    case 0xE: c->v[x] <<= 1;                break;
+    }
+
+    c->pc += 2;
+    DEBUG("v%u op%x v%u => %x, vf pending", x, N(instruction), y, c->v[x]);
+}
+
+// drop every entry whose instructions overlap the written range
+static inline
+void predecode_invalidate(Predecode *p, uint32_t addr, uint32_t len) {
+    const uint32_t start = addr >= MAX_FUSED_LEN * 2 - 1 ? addr - (MAX_FUSED_LEN * 2 - 1) : 0;
+    const uint32_t end = addr + len < MEM_SIZE ? addr + len : MEM_SIZE;
+    for (uint32_t a = start; a < end; ++a)
+        p->ops[a].kind = EXEC_UNDECODED;
+}
+
+static inline
+int predecode_is_store(uint16_t instruction) {
+    return OP(instruction) == 0xF && (NN(instruction) == 0x33 || NN(instruction) == 0x55);
+}
+
+// Executes one decoded entry and returns the number of instructions it retired.
+// Entries never store to memory except through EXEC_SINGLE, callers check
+// predecode_is_store on raw[0] to invalidate their translations
+static inline
+uint32_t predecode_execute(Chip8 *c, const DecodedOp *op, PendingFlag *pending, const int idle_probes) {
+    const uint16_t *raw = op->raw;
+
+    switch (op->kind) {
+    case EXEC_LD_LD_DRAW:
+        c->v[X(raw[0])] = NN(raw[0]);
+        c->v[X(raw[1])] = NN(raw[1]);
+        c->pc += 6;
+        DEBUG("fused v[%u] = %u; v[%u] = %u; draw", X(raw[0]), NN(raw[0]), X(raw[1]), NN(raw[1]));
+        chip8_load_pixels(c, c->v[X(raw[2])], c->v[Y(raw[2])], N(raw[2]));
+        return 3;
+    case EXEC_LD_I_DRAW:
+        c->i = NNN(raw[0]);
+        c->pc += 4;
+        DEBUG("fused i = %u; draw", c->i);
+        chip8_load_pixels(c, c->v[X(raw[1])], c->v[Y(raw[1])], N(raw[1]));
+        return 2;
+    case EXEC_ADD_SKIP_JUMP:
+        c->v[X(raw[0])] += NN(raw[0]);
+        DEBUG("fused v[%u] += %u", X(raw[0]), NN(raw[0]));
+        // a taken skip never executes the jump
+        if (c->v[X(raw[0])] == NN(raw[1])) {
+            c->pc += 6;
+            return 2;
+        }
+        c->pc = NNN(raw[2]);
+        return 3;
+    case EXEC_TIMER_SKIP_JUMP:
+        if (idle_probes)
+            chip8_note_timer_read(c, c->pc);
+        c->v[X(raw[0])] = c->delay_timer;
+        DEBUG("fused v[%u] = delay_timer (%u)", X(raw[0]), c->delay_timer);
+        if (c->v[X(raw[0])] == NN(raw[1])) {
+            c->pc += 6;
+            return 2;
+        }
+        c->pc = NNN(raw[2]);
+        return 3;
+    case EXEC_ALU_FLAG:
+        predecode_execute_flag_alu(c, pending, raw[0]);
+        return 1;
+    default:
+        c->pc += 2;
+        chip8_decode_execute_variant(c, raw[0], 0, idle_probes);
+        return 1;
+    }
+}
+
+// returns the number of instructions retired, the run loops below take display_wait
+// as a constant so the DXYN check is folded away when the quirk is off
+static inline
+uint32_t predecode_run(Chip8 *c, Predecode *p, uint32_t instruction_count, const int display_wait, const int idle_probes) {
+    uint32_t remaining = instruction_count;
+    PendingFlag pending = {0};
+
+    while (remaining && !(display_wait && c->drawn)) {
+        if (c->pc + 2 > MEM_SIZE) {
+            predecode_materialize_vf(c, &pending);
+            chip8_fetch(c);
+        }
+
+        DecodedOp *op = &p->ops[c->pc];
+        if (op->kind == EXEC_UNDECODED)
+            predecode_decode(c->mem, op, c->pc);
+
+        stats.dispatches++;
+        if (p->count_hits)
+            p->hits[c->pc]++;
+
+        if (pending.op && op->vf)
+            predecode_materialize_vf(c, &pending);
+
+        const uint16_t i = c->i;
+        const uint16_t first = op->raw[0];
+
+        // not enough budget left in this batch for the whole sequence, split it again
+        if (op->len > remaining) {
+            c->pc += 2;
+            chip8_decode_execute_variant(c, first, 0, idle_probes);
+            remaining--;
+        } else {
+            remaining -= predecode_execute(c, op, &pending, idle_probes);
+        }
+
+        if (predecode_is_store(first))
+            predecode_invalidate(p, i, MAX_STORE_LEN);
+    }
+
+    // leaving the predecoded region, VF has to hold its architectural value
+    predecode_materialize_vf(c, &pending);
+    return instruction_count - remaining;
+}
+
+static inline
+uint32_t chip8_interpret_variant(Chip8 *c, uint32_t instruction_count, const int display_wait, const int idle_probes) {
+    uint32_t i = 0;
+    while (i < instruction_count && !(display_wait && c->drawn)) {
+        uint16_t instruction = chip8_fetch(c);
+        chip8_decode_execute_variant(c, instruction, 0, idle_probes);
+        i++;
+    }
+    return i;
+}
+
+static inline
+uint32_t chip8_interpret(Chip8 *c, uint32_t instruction_count) {
+    c->drawn = 0;
+    return c->config.quirks & QUIRK_DISPLAY_WAIT ?
+        chip8_interpret_variant(c, instruction_count, 1, 0) :
+        chip8_interpret_variant(c, instruction_count, 0, 0);
+}
+
+static inline
+int tiered_ends_block(const DecodedOp *op, int display_wait) {
+    const uint16_t w = op->raw[op->len - 1];
+    switch (OP(w)) {
+    case 0x0:
+        return w != 0x00E0;
+    case 0x1: case 0x2: case 0xB:
+    case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+        return 1;
+    case 0xF:
+        return NN(w) == 0x0A;
+    case 0xD:
+        return display_wait;
+    default:
+        return 0;
+    }
+}
+
+static inline
+uint32_t tiered_window_size(uint32_t addr) {
+    return addr + TIER_WINDOW_SIZE <= MEM_SIZE ? TIER_WINDOW_SIZE : MEM_SIZE - addr;
+}
+
+static inline
+uint32_t tiered_last_page(uint32_t addr) {
+    return (addr + tiered_window_size(addr) - 1) / TIER_PAGE_SIZE;
+}
+
+// conservative register/index locations an instruction reads and writes
+static inline
+void ir_access(uint16_t w, uint32_t *reads, uint32_t *writes) {
+    const uint32_t x = IR_LOC(X(w));
+    const uint32_t y = IR_LOC(Y(w));
+    const uint32_t vf = IR_LOC(0xF);
+    const uint32_t i = IR_LOC(IR_LOC_I);
+
+    *reads = *writes = 0;
+    switch (OP(w)) {
+    case 0x3: case 0x4: case 0xE:   *reads = x;                     break;
+    case 0x5: case 0x9:             *reads = x | y;                 break;
+    case 0x6: case 0xC:             *writes = x;                    break;
+    case 0x7:                       *reads = x; *writes = x;        break;
+    case 0xA:                       *writes = i;                    break;
+    case 0xB:                       *reads = IR_LOC(0) | x; *writes = i; break;
+    case 0xD:                       *reads = x | y | i; *writes = vf; break;
+    case 0x8:
+        switch (N(w)) {
+        case 0x0:                   *reads = y; *writes = x;        break;
+        case 0x1: case 0x2: case 0x3: *reads = x | y; *writes = x;  break;
+        case 0x4: case 0x5: case 0x7:
+        case 0x6: case 0xE:         *reads = x | y; *writes = x | vf; break;
+        }
+        break;
+    case 0xF:
+        switch (NN(w)) {
+        case 0x07:                  *writes = x;                    break;
+        case 0x15: case 0x18:       *reads = x;                     break;
+        case 0x1E:                  *reads = x | i; *writes = i | vf; break;
+        case 0x29:                  *reads = x; *writes = i;        break;
+        case 0x65:                  *reads = i; *writes = IR_LOC(X(w) + 1) - 1; break;
+        // stores act as a barrier so a block can stop right after one
+        case 0x33: case 0x55:       *reads = IR_LOC_ALL;            break;
+        }
+        break;
+    }
+}
+
+static inline
+void ir_op_access(const IrOp *ir, uint32_t *reads, uint32_t *writes) {
+    switch (ir->kind) {
+    case IR_SET_V:      *reads = 0;                 *writes = IR_LOC(ir->x);        return;
+    case IR_ADD_V:      *reads = IR_LOC(ir->x);     *writes = IR_LOC(ir->x);        return;
+    case IR_SET_I:      *reads = 0;                 *writes = IR_LOC(IR_LOC_I);     return;
+    case IR_SET_I_ADD_V:
+        *reads = IR_LOC(ir->x);
+        *writes = IR_LOC(IR_LOC_I) | (ir->dead_vf ? 0 : IR_LOC(0xF));
+        return;
+    }
+
+    *reads = *writes = 0;
+    for (uint32_t k = 0; k < ir->op.len; ++k) {
+        uint32_t r, w;
+        ir_access(ir->op.raw[k], &r, &w);
+        *reads |= r;
+        *writes |= w;
+    }
+}
+
+static inline
+uint32_t ir_lift(const DecodedOp *ops, uint32_t count, uint32_t addr, IrOp *out) {
+    uint32_t len = 0;
+
+    for (uint32_t k = 0; k < count; ++k) {
+        const DecodedOp *op = &ops[k];
+        const uint16_t w = op->raw[0];
+        const uint16_t next = addr + op->len * 2;
+        const int single = op->kind == EXEC_SINGLE;
+
+        if (single && OP(w) == 0xF && NN(w) == 0x1E && len && out[len-1].kind == IR_SET_I) {
+            IrOp *prev = &out[len-1];
+            prev->kind = IR_SET_I_ADD_V;
+            prev->x = X(w);
+            prev->vf = 1;
+            prev->retired++;
+            prev->next = next;
+        } else {
+            IrOp *ir = &out[len++];
+            *ir = (IrOp) { .kind = IR_EXEC, .op = *op, .vf = op->vf, .retired = op->len, .addr = addr, .next = next };
+
+            if (single && (OP(w) == 0x6 || OP(w) == 0x7)) {
+                ir->kind = OP(w) == 0x6 ? IR_SET_V : IR_ADD_V;
+                ir->x = X(w);
+                ir->imm = NN(w);
+            } else if (single && OP(w) == 0xA) {
+                ir->kind = IR_SET_I;
+                ir->imm = NNN(w);
+            }
+        }
+
+        addr = next;
+    }
+    return len;
+}
+
+// 6XNN; 7XNN becomes 6XNN; 6X(NN+NN), the first write is then dead
+static inline
+void ir_fold_constants(IrOp *ops, uint32_t len) {
+    uint32_t known = 0;
+    uint8_t value[REG_COUNT];
+
+    for (uint32_t k = 0; k < len; ++k) {
+        IrOp *ir = &ops[k];
+
+        if (ir->kind == IR_ADD_V && known & IR_LOC(ir->x)) {
+            ir->kind = IR_SET_V;
+            ir->imm = (uint8_t)(value[ir->x] + ir->imm);
+        }
+
+        if (ir->kind == IR_SET_V) {
+            known |= IR_LOC(ir->x);
+            value[ir->x] = ir->imm;
+            continue;
+        }
+
+        uint32_t reads, writes;
+        ir_op_access(ir, &reads, &writes);
+        known &= ~writes;
+    }
+}
+
+// Removes register/index writes that are overwritten before being read. The
+// eliminated instructions are retired by the op that overwrites them, and the
+// block may not stop anywhere in between since the state there is incomplete
+static inline
+uint32_t ir_eliminate_dead_writes(IrOp *ops, uint32_t len) {
+    uint32_t live = IR_LOC_ALL;
+    uint8_t killer[IR_LOC_COUNT];
+    uint8_t removed[TIER_MAX_BLOCK_LEN] = {0};
+    uint8_t inconsistent[TIER_MAX_BLOCK_LEN] = {0};
+
+    memset(killer, len, sizeof(killer));
+
+    for (int32_t k = len - 1; k >= 0; --k) {
+        IrOp *ir = &ops[k];
+
+        if (ir->kind == IR_SET_I_ADD_V && !(live & IR_LOC(0xF))) {
+            ir->dead_vf = 1;
+            for (uint32_t j = k + 1; j <= killer[0xF] && j < len; ++j)
+                inconsistent[j] = 1;
+        }
+
+        uint32_t reads, writes;
+        ir_op_access(ir, &reads, &writes);
+
+        const int pure = ir->kind == IR_SET_V || ir->kind == IR_ADD_V || ir->kind == IR_SET_I;
+        if (pure && !(writes & live)) {
+            const uint32_t kill = killer[ir->kind == IR_SET_I ? IR_LOC_I : ir->x];
+            ops[kill].retired += ir->retired;
+            ops[kill].eliminated += ir->retired;
+            removed[k] = 1;
+            for (uint32_t j = k + 1; j <= kill; ++j)
+                inconsistent[j] = 1;
+            continue;
+        }
+
+        for (uint32_t loc = 0; loc < IR_LOC_COUNT; ++loc) {
+            if (writes & IR_LOC(loc))
+                killer[loc] = k;
+        }
+        live = (live & ~writes) | reads;
+    }
+
+    uint32_t kept = 0;
+    for (uint32_t k = 0; k < len; ++k) {
+        if (!removed[k]) {
+            inconsistent[kept] = inconsistent[k];
+            ops[kept++] = ops[k];
+        }
+    }
+
+    // the block entry always checks the budget for its first span
+    uint32_t span = 0;
+    for (int32_t k = kept - 1; k >= 0; --k) {
+        span += ops[k].retired;
+        ops[k].span = 0;
+        if (k == 0 || !inconsistent[k]) {
+            ops[k].span = span;
+            span = 0;
+        }
+    }
+
+    return kept;
+}
+
+// runs on the compiler thread, only ever looks at the bytes copied into the request
+static inline
+void tiered_compile(CompiledBlock *b, const CompileRequest *req, uint8_t *mem) {
+    const uint32_t window = tiered_window_size(req->addr);
+    memset(mem, 0, MEM_SIZE);
+    memcpy(&mem[req->addr], req->bytes, window);
+
+    b->addr = req->addr;
+    b->first_page = req->first_page;
+    b->page_gen[0] = req->page_gen[0];
+    b->page_gen[1] = req->page_gen[1];
+
+    DecodedOp ops[TIER_MAX_BLOCK_LEN];
+    uint32_t count = 0;
+    uint32_t addr = req->addr;
+    while (count < TIER_MAX_BLOCK_LEN && addr + 2 <= req->addr + window) {
+        DecodedOp *op = &ops[count++];
+        predecode_decode(mem, op, addr);
+        addr += op->len * 2;
+        if (tiered_ends_block(op, req->display_wait))
+            break;
+    }
+
+    b->len = ir_lift(ops, count, req->addr, b->ops);
+    ir_fold_constants(b->ops, b->len);
+    b->len = ir_eliminate_dead_writes(b->ops, b->len);
+}
+
+static
+THREAD_FUNC(tiered_compiler_thread) {
+    Tiered *t = arg;
+    uint8_t mem[MEM_SIZE];
+
+    while (platform_atomic_load_u32(&t->running)) {
+        const uint32_t tail = t->queue_tail;
+        if (tail == platform_atomic_load_u32(&t->queue_head)) {
+            platform_sleep(1);
+            continue;
+        }
+
+        const CompileRequest *req = &t->queue[tail % TIER_QUEUE_SIZE];
+        CompiledBlock *b = NULL;
+        if (t->pool_used < TIER_MAX_BLOCKS) {
+            b = &t->pool[t->pool_used++];
+        } else if (t->freed_tail != platform_atomic_load_u32(&t->freed_head)) {
+            b = t->freed[t->freed_tail % TIER_MAX_BLOCKS];
+            platform_atomic_store_u32(&t->freed_tail, t->freed_tail + 1);
+        }
+
+        if (b) {
+            const uint64_t start = trace_begin(trace_compiler);
+            tiered_compile(b, req, mem);
+            trace_end(trace_compiler, TRACE_COMPILE, start);
+            platform_atomic_store_ptr((void **)&t->blocks[req->addr], b);
+            platform_atomic_store_u32(&t->compiled, t->compiled + 1);
+        } else {
+            platform_atomic_store_u32(&t->dropped, t->dropped + 1);
+        }
+        platform_atomic_store_u32(&t->queue_tail, tail + 1);
+    }
+
+    THREAD_RETURN;
+}
+
+static inline
+void tiered_start(Tiered *t) {
+    t->running = 1;
+    if (!platform_thread_start(&t->thread, tiered_compiler_thread, t))
+        FATAL("Failed to start compiler thread");
+}
+
+static inline
+void tiered_stop(Tiered *t) {
+    platform_atomic_store_u32(&t->running, 0);
+    platform_thread_join(t->thread);
+}
+
+// drops the request when the queue is full, the block asks again on its next entry
+static inline
+void tiered_request(Tiered *t, const Chip8 *c, uint16_t addr) {
+    const uint32_t head = t->queue_head;
+    if (head - platform_atomic_load_u32(&t->queue_tail) >= TIER_QUEUE_SIZE)
+        return;
+
+    CompileRequest *req = &t->queue[head % TIER_QUEUE_SIZE];
+    req->addr = addr;
+    req->first_page = addr / TIER_PAGE_SIZE;
+    req->page_gen[0] = t->page_gen[req->first_page];
+    req->page_gen[1] = t->page_gen[tiered_last_page(addr)];
+    req->display_wait = c->config.quirks & QUIRK_DISPLAY_WAIT;
+    memcpy(req->bytes, &c->mem[addr], tiered_window_size(addr));
+
+    t->requested[addr] = 1;
+    platform_atomic_store_u32(&t->queue_head, head + 1);
+}
+
+static inline
+void tiered_note_store(Tiered *t, uint32_t addr) {
+    const uint32_t last = addr + MAX_STORE_LEN - 1 < MEM_SIZE ? addr + MAX_STORE_LEN - 1 : MEM_SIZE - 1;
+    for (uint32_t page = addr / TIER_PAGE_SIZE; page <= last / TIER_PAGE_SIZE; ++page)
+        t->page_gen[page]++;
+}
+
+static inline
+int tiered_block_valid(const Tiered *t, const CompiledBlock *b) {
+    return t->page_gen[b->first_page] == b->page_gen[0] &&
+           t->page_gen[tiered_last_page(b->addr)] == b->page_gen[1];
+}
+
+// Returns the number of instructions retired, 0 if the budget did not fit the first span.
+// Only stops at op boundaries where no eliminated write is still outstanding
+static inline
+uint32_t tiered_execute_block(Chip8 *c, Tiered *t, const CompiledBlock *b, uint32_t budget, const int idle_probes) {
+    PendingFlag pending = {0};
+    uint32_t retired = 0;
+
+    for (uint32_t k = 0; k < b->len; ++k) {
+        const IrOp *ir = &b->ops[k];
+        if (ir->span && ir->span > budget - retired)
+            break;
+
+        if (pending.op && ir->vf)
+            predecode_materialize_vf(c, &pending);
+
+        stats.dispatches++;
+        stats.ir_eliminated += ir->eliminated;
+        retired += ir->retired;
+
+        switch (ir->kind) {
+        case IR_SET_V:
+            c->v[ir->x] = ir->imm;
+            c->pc = ir->next;
+            continue;
+        case IR_ADD_V:
+            c->v[ir->x] += ir->imm;
+            c->pc = ir->next;
+            continue;
+        case IR_SET_I:
+            c->i = ir->imm;
+            c->pc = ir->next;
+            continue;
+        case IR_SET_I_ADD_V:
+            c->i = ir->imm + c->v[ir->x];
+            if (!ir->dead_vf)
+                c->v[0xF] = c->i > MEM_SIZE;
+            c->pc = ir->next;
+            continue;
+        }
+
+        const uint16_t i = c->i;
+        c->pc = ir->addr;
+        retired -= ir->op.len - predecode_execute(c, &ir->op, &pending, idle_probes);
+
+        // the store may have overwritten this very block
+        if (predecode_is_store(ir->op.raw[0])) {
+            tiered_note_store(t, i);
+            if (!tiered_block_valid(t, b))
+                break;
+        }
+
+        if (c->pc != ir->next)
+            break;
+    }
+
+    predecode_materialize_vf(c, &pending);
+    return retired;
+}
+
+// blocks compiled for display_wait end at DXYN, so checking between blocks is enough
+static inline
+uint32_t tiered_run(Chip8 *c, Tiered *t, uint32_t instruction_count, const int display_wait, const int idle_probes) {
+    uint32_t remaining = instruction_count;
+
+    while (remaining && !(display_wait && c->drawn)) {
+        const uint16_t pc = c->pc;
+
+        if (pc + 2 <= MEM_SIZE) {
+            CompiledBlock *b = platform_atomic_load_ptr((void *const *)&t->blocks[pc]);
+            if (b && tiered_block_valid(t, b)) {
+                const uint32_t retired = tiered_execute_block(c, t, b, remaining, idle_probes);
+                stats.block_runs += retired != 0;
+                remaining -= retired;
+                if (retired)
+                    continue;
+            } else if (b) {
+                platform_atomic_store_ptr((void **)&t->blocks[pc], NULL);
+                t->freed[t->freed_head % TIER_MAX_BLOCKS] = b;
+                platform_atomic_store_u32(&t->freed_head, t->freed_head + 1);
+                t->requested[pc] = 0;
+                t->block_hits[pc] = 0;
+                stats.block_invalidations++;
+            }
+        }
+
+        const uint16_t i = c->i;
+        const uint16_t instruction = chip8_fetch(c);
+        chip8_decode_execute_variant(c, instruction, 0, idle_probes);
+        stats.dispatches++;
+        remaining--;
+
+        if (predecode_is_store(instruction))
+            tiered_note_store(t, i);
+
+        // entered a new block
+        if (c->pc != pc + 2 && c->pc + 2 <= MEM_SIZE && !t->requested[c->pc]) {
+            if (t->block_hits[c->pc] < TIER_HOT_THRESHOLD)
+                t->block_hits[c->pc]++;
+            else
+                tiered_request(t, c, c->pc);
+        }
+    }
+
+    return instruction_count - remaining;
+}
+
+// FNV-1a
+static inline
+uint64_t hash_bytes(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline
+void tcache_path(char *out, const char *dir, const uint8_t *rom, uint32_t rom_size, uint32_t quirks) {
+    snprintf(out, TCACHE_PATH_SIZE, "%s/%016llx-%x.c8tc",
+            dir,
+            (unsigned long long)hash_bytes(rom, rom_size),
+            quirks);
+}
+
+// the decoder looks at all MAX_FUSED_LEN words, so all of them have to match
+static inline
+int tcache_entry_matches(const uint8_t *mem, const DecodedOp *op, uint32_t addr) {
+    if (op->kind == EXEC_UNDECODED)
+        return 0;
+    for (uint32_t i = 0; i < MAX_FUSED_LEN; ++i) {
+        if (op->raw[i] != predecode_word(mem, addr + i * 2))
+            return 0;
+    }
+    return 1;
+}
+
+static inline
+void tcache_mark(uint8_t *bitmap, uint32_t addr, uint32_t rom_size) {
+    if (addr >= PROGRAM_START_OFFSET && addr < PROGRAM_START_OFFSET + rom_size)
+        bitmap[addr / BYTE_SIZE] |= 1 << (addr % BYTE_SIZE);
+}
+
+// block starts are jump/call targets, return sites and both sides of every skip
+static inline
+void tcache_mark_block_starts(uint8_t *bitmap, const DecodedOp *op, uint32_t addr, uint32_t rom_size) {
+    for (uint32_t i = 0; i < op->len; ++i) {
+        const uint16_t w = op->raw[i];
+        const uint32_t next = addr + (i + 1) * 2;
+
+        switch (OP(w)) {
+        case 0x2:
+            tcache_mark(bitmap, next, rom_size);
+            // fallthrough
+        case 0x1:
+            tcache_mark(bitmap, NNN(w), rom_size);
+            break;
+        case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+            tcache_mark(bitmap, next, rom_size);
+            tcache_mark(bitmap, next + 2, rom_size);
+            break;
+        }
+    }
+}
+
+static inline
+int tcache_load(Predecode *p, const Chip8 *c, uint32_t rom_size, const char *path) {
+    size_t size = 0;
+    const TranslationCacheFile *file = platform_map_file(path, &size);
+    if (!file)
+        return 0;
+
+    const uint8_t *rom = &c->mem[PROGRAM_START_OFFSET];
+    const int valid = size == sizeof(*file) &&
+        !memcmp(file->magic, TCACHE_MAGIC, sizeof(file->magic)) &&
+        file->version == TCACHE_VERSION &&
+        file->rom_hash == hash_bytes(rom, rom_size) &&
+        file->quirks == c->config.quirks &&
+        file->rom_size == rom_size &&
+        file->hot_count <= TCACHE_HOT_BLOCKS &&
+        !memcmp(file->rom, rom, rom_size);
+
+    uint32_t loaded = 0;
+    if (valid) {
+        for (uint32_t i = 0; i < rom_size; ++i) {
+            const uint32_t addr = PROGRAM_START_OFFSET + i;
+            if (tcache_entry_matches(c->mem, &file->ops[i], addr)) {
+                p->ops[addr] = file->ops[i];
+                loaded++;
+            }
+        }
+        p->hot_count = file->hot_count;
+        memcpy(p->hot_blocks, file->hot_blocks, sizeof(p->hot_blocks));
+        printf("tcache: loaded %u entries, %u hot blocks from %s\n", loaded, p->hot_count, path);
+    } else {
+        printf("tcache: ignoring stale cache file %s\n", path);
+    }
+
+    platform_unmap_file(file, size);
+    return valid;
+}
+
+// pristine_mem is memory as it was right after loading the rom, entries decoded
+// from self-modified code are left out
+static inline
+void tcache_save(const Predecode *p, const uint8_t *pristine_mem, uint32_t rom_size, uint32_t quirks, const char *path) {
+    static TranslationCacheFile file;
+    memset(&file, 0, sizeof(file));
+
+    memcpy(file.magic, TCACHE_MAGIC, sizeof(file.magic));
+    file.version = TCACHE_VERSION;
+    file.rom_hash = hash_bytes(&pristine_mem[PROGRAM_START_OFFSET], rom_size);
+    file.quirks = quirks;
+    file.rom_size = rom_size;
+    memcpy(file.rom, &pristine_mem[PROGRAM_START_OFFSET], rom_size);
+
+    // hot blocks are picked among the block starts, the loader only needs the list
+    uint8_t block_starts[COVERAGE_BITMAP_SIZE] = {0};
+    tcache_mark(block_starts, PROGRAM_START_OFFSET, rom_size);
+    for (uint32_t i = 0; i < rom_size; ++i) {
+        const uint32_t addr = PROGRAM_START_OFFSET + i;
+        if (tcache_entry_matches(pristine_mem, &p->ops[addr], addr)) {
+            file.ops[i] = p->ops[addr];
+            tcache_mark_block_starts(block_starts, &p->ops[addr], addr, rom_size);
+        }
+    }
+
+    // hottest block starts first
+    for (file.hot_count = 0; file.hot_count < TCACHE_HOT_BLOCKS; file.hot_count++) {
+        uint32_t best = 0, best_hits = 0;
+        for (uint32_t addr = PROGRAM_START_OFFSET; addr < PROGRAM_START_OFFSET + rom_size; ++addr) {
+            const int is_start = block_starts[addr / BYTE_SIZE] & (1 << (addr % BYTE_SIZE));
+            int taken = 0;
+            for (uint32_t i = 0; i < file.hot_count; ++i)
+                taken |= file.hot_blocks[i] == addr;
+            if (is_start && !taken && p->hits[addr] > best_hits)
+                best = addr, best_hits = p->hits[addr];
+        }
+        if (!best_hits)
+            break;
+        file.hot_blocks[file.hot_count] = best;
+    }
+
+    char tmp_path[TCACHE_PATH_SIZE + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "tcache: failed to open %s\n", tmp_path);
+        return;
+    }
+    const int written = fwrite(&file, sizeof(file), 1, out) == 1;
+    fclose(out);
+
+    if (!written || !platform_replace_file(tmp_path, path))
+        fprintf(stderr, "tcache: failed to write %s\n", path);
+}
+
+static const char *const EXEC_KIND_NAMES[] = {
+    [EXEC_UNDECODED]        = "EXEC_UNDECODED",
+    [EXEC_SINGLE]           = "EXEC_SINGLE",
+    [EXEC_LD_LD_DRAW]       = "EXEC_LD_LD_DRAW",
+    [EXEC_LD_I_DRAW]        = "EXEC_LD_I_DRAW",
+    [EXEC_ADD_SKIP_JUMP]    = "EXEC_ADD_SKIP_JUMP",
+    [EXEC_TIMER_SKIP_JUMP]  = "EXEC_TIMER_SKIP_JUMP",
+    [EXEC_ALU_FLAG]         = "EXEC_ALU_FLAG",
+};
+
+// writes s as a quoted C string literal, octal escapes can not run into the next character
+static inline
+void embed_write_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; ++s) {
+        const unsigned char ch = *s;
+        if (ch == '"' || ch == '\\')
+            fprintf(out, "\\%c", ch);
+        else if (ch < 0x20 || ch == 0x7F)
+            fprintf(out, "\\%03o", ch);
+        else
+            fputc(ch, out);
+    }
+    fputc('"', out);
+}
+
+// Writes the header for an EMBED_ROM build. Decoding does not depend on the
+// quirks, so one header serves every quirk set
+static inline
+int embed_write(const char *rom, const char *path) {
+    static Chip8 chip8;
+    Chip8 *c = &chip8;
+    chip8_load_to_mem(c, FONT_DATA_OFFSET, FONT_DATA, sizeof(FONT_DATA));
+    const size_t rom_size = chip8_load_rom(c, rom);
+    if (!rom_size)
+        FATAL("Empty rom: %s", rom);
+
+    FILE *out = fopen(path, "w");
+    if (!out)
+        FATAL("Failed to open %s", path);
+
+    const char *name = strrchr(rom, '/') ? strrchr(rom, '/') + 1 : rom;
+    fprintf(out, "// generated by chip8 --embed from ");
+    embed_write_string(out, name);
+    fprintf(out, ", do not edit\n#define EMBEDDED_ROM_NAME ");
+    embed_write_string(out, name);
+    fprintf(out, "\n");
+    fprintf(out, "#define EMBEDDED_ROM_SIZE %zu\n\n", rom_size);
+
+    fprintf(out, "static const uint8_t EMBEDDED_MEM[MEM_SIZE] = {");
+    for (uint32_t addr = 0; addr < PROGRAM_START_OFFSET + rom_size; ++addr)
+        fprintf(out, "%s0x%02x,", addr % 16 ? " " : "\n    ", c->mem[addr]);
+    fprintf(out, "\n};\n\n");
+
+    // entry i decodes the instruction at PROGRAM_START_OFFSET + i
+    fprintf(out, "static const DecodedOp EMBEDDED_OPS[EMBEDDED_ROM_SIZE] = {\n");
+    for (uint32_t i = 0; i < rom_size; ++i) {
+        DecodedOp op;
+        predecode_decode(c->mem, &op, PROGRAM_START_OFFSET + i);
+        fprintf(out, "    { %s, %u, %u, { 0x%04x, 0x%04x, 0x%04x } },\n",
+                EXEC_KIND_NAMES[op.kind], op.len, op.vf, op.raw[0], op.raw[1], op.raw[2]);
+    }
+    fprintf(out, "};\n");
+
+    const int failed = ferror(out);
+    fclose(out);
+    if (failed)
+        FATAL("Failed to write %s", path);
+
+    printf("embed: wrote %s, build with -DEMBED_ROM='\"%s\"'\n", path, path);
+    return 0;
+}
+
+static inline
+uint32_t chip8_run_variant(Chip8 *c, uint32_t instruction_count, const int display_wait, const int idle_probes) {
+    if (c->profile) {
+        uint32_t i = 0;
+        while (i < instruction_count && !(display_wait && c->drawn)) {
+            chip8_decode_execute_variant(c, chip8_fetch_variant(c, 1), 1, idle_probes);
+            i++;
+        }
+        stats.dispatches += i;
+        return i;
+    }
+
+    if (c->predecode)
+        return predecode_run(c, c->predecode, instruction_count, display_wait, idle_probes);
+
+    if (c->tiered)
+        return tiered_run(c, c->tiered, instruction_count, display_wait, idle_probes);
+
+    const uint32_t retired = chip8_interpret_variant(c, instruction_count, display_wait, idle_probes);
+    stats.dispatches += retired;
+    return retired;
+}
+
+// Pick the dispatch variant once per batch so the normal path stays free of
+// instrumentation. Returns the instructions retired, fewer than instruction_count
+// when a draw ended the frame early. idle_probes is only set by the governor
+static inline
+uint32_t chip8_run_probed(Chip8 *c, uint32_t instruction_count, const int idle_probes) {
+    c->drawn = 0;
+    const uint32_t retired = c->config.quirks & QUIRK_DISPLAY_WAIT ?
+        chip8_run_variant(c, instruction_count, 1, idle_probes) :
+        chip8_run_variant(c, instruction_count, 0, idle_probes);
+
+    stats.instructions += retired;
+    return retired;
+}
+
+static inline
+uint32_t chip8_run(Chip8 *c, uint32_t instruction_count) {
+    return chip8_run_probed(c, instruction_count, 0);
+}
+
+static inline
+void chip8_update_timers(Chip8 *c) {
+    c->delay_timer -= c->delay_timer != 0;
+    c->sound_timer -= c->sound_timer != 0;
+}
+
+static inline
+int chip8_state_equal(const Chip8 *a, const Chip8 *b) {
+    return !memcmp(a->mem, b->mem, sizeof(a->mem)) &&
+           !memcmp(a->stack, b->stack, sizeof(a->stack)) &&
+           !memcmp(a->v, b->v, sizeof(a->v)) &&
+           !memcmp(a->display, b->display, sizeof(a->display)) &&
+           a->pc == b->pc &&
+           a->i == b->i &&
+           a->sp == b->sp &&
+           a->delay_timer == b->delay_timer &&
+           a->sound_timer == b->sound_timer &&
+           a->key_wait == b->key_wait &&
+           a->rng == b->rng;
+}
+
+// a savestate is a plain copy of the instance
+static inline
+void chip8_save(Chip8 *snapshot, const Chip8 *c) {
+    memcpy(snapshot, c, sizeof(*snapshot));
+}
+
+// Translations of memory that differs from the snapshot are dropped, compared
+// in TIER_PAGE_SIZE chunks so an unchanged memory costs one pass of memcmp
+static inline
+void chip8_restore(Chip8 *c, const Chip8 *snapshot) {
+    for (uint32_t page = 0; page < TIER_PAGE_COUNT; ++page) {
+        const uint32_t addr = page * TIER_PAGE_SIZE;
+        if (!memcmp(&c->mem[addr], &snapshot->mem[addr], TIER_PAGE_SIZE))
+            continue;
+        if (c->predecode)
+            predecode_invalidate(c->predecode, addr, TIER_PAGE_SIZE);
+        if (c->tiered)
+            c->tiered->page_gen[page]++;
+    }
+    memcpy(c, snapshot, sizeof(*c));
+}
+
+// a write from outside the emulated program, translations of that byte are dropped
+static inline
+void chip8_poke(Chip8 *c, uint16_t addr, uint8_t value) {
+    if (c->mem[addr] == value)
+        return;
+
+    c->mem[addr] = value;
+    if (c->predecode)
+        predecode_invalidate(c->predecode, addr, 1);
+    if (c->tiered)
+        c->tiered->page_gen[addr / TIER_PAGE_SIZE]++;
+}
+
+// Fixed size objects carved from one arena, optionally on huge pages. The first
+// slot holds the template and every acquired object is reset to it with one
+// copy. Free slots are linked through their first bytes, never handed out
+// slots are taken in order so the arena is only touched as it is used
+typedef struct {
+    uint8_t     *arena;
+    size_t       arena_size;
+    ArenaPages   pages;
+    uint32_t     size;
+    uint32_t     stride;
+    uint32_t     capacity;
+    uint32_t     used;
+    uint32_t     free_head;
+} InstancePool;
+
+static const char *const ARENA_PAGES_NAMES[] = {
+    [ARENA_SMALL_PAGES]             = "small pages",
+    [ARENA_TRANSPARENT_HUGE_PAGES]  = "transparent huge pages",
+    [ARENA_HUGE_PAGES]              = "huge pages",
+};
+
+static inline
+void pool_init(InstancePool *p, const void *template, uint32_t size, uint32_t capacity, int huge) {
+    const uint32_t stride = (size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    const size_t bytes = (size_t)stride * (capacity + 1);
+
+    *p = (InstancePool) { .size = size, .stride = stride, .capacity = capacity, .free_head = POOL_NONE };
+    p->arena_size = (bytes + ARENA_HUGE_PAGE_SIZE - 1) / ARENA_HUGE_PAGE_SIZE * ARENA_HUGE_PAGE_SIZE;
+    p->arena = platform_map_arena(p->arena_size, huge, &p->pages);
+    if (!p->arena)
+        FATAL("Failed to map a %zu byte instance arena", p->arena_size);
+    memcpy(p->arena, template, size);
+}
+
+static inline
+void pool_destroy(InstancePool *p) {
+    platform_unmap_arena(p->arena, p->arena_size);
+    p->arena = NULL;
+}
+
+static inline
+void pool_reset(const InstancePool *p, void *object) {
+    memcpy(object, p->arena, p->size);
+}
+
+// NULL when all capacity objects are in use
+static inline
+void *pool_acquire(InstancePool *p) {
+    uint8_t *object;
+    if (p->free_head != POOL_NONE) {
+        object = &p->arena[(size_t)p->free_head * p->stride];
+        memcpy(&p->free_head, object, sizeof(p->free_head));
+    } else if (p->used < p->capacity) {
+        object = &p->arena[(size_t)++p->used * p->stride];
+    } else {
+        return NULL;
+    }
+    pool_reset(p, object);
+    return object;
+}
+
+static inline
+void pool_release(InstancePool *p, void *object) {
+    memcpy(object, &p->free_head, sizeof(p->free_head));
+    p->free_head = (uint32_t)(((uint8_t *)object - p->arena) / p->stride);
+}
+
+static inline
+void stats_note_first_frame(void) {
+    if (stats.startup_ns)
+        return;
+    stats.startup_ns = platform_time_ns() - stats.main_start_ns;
+    stats.startup_cpu_ns = platform_process_cpu_ns();
+}
+
+static inline
+void print_stats(const Chip8 *c) {
+    printf("frames:        %llu\n", (unsigned long long)stats.frames);
+    printf("instructions:  %llu\n", (unsigned long long)stats.instructions);
+    printf("dispatches:    %llu (%.1f%% fewer than instructions)\n",
+            (unsigned long long)stats.dispatches,
+            stats.instructions ? 100.0 * (stats.instructions - stats.dispatches) / stats.instructions : 0.0);
+    printf("batch time:    avg %.2f us, max %.2f us\n",
+            stats.frames ? stats.batch_ns_total / 1000.0 / stats.frames : 0.0,
+            stats.batch_ns_max / 1000.0);
+    printf("startup:       %.2f ms from main to the first frame, %.2f ms of process CPU time\n",
+            stats.startup_ns / 1e6, stats.startup_cpu_ns / 1e6);
+
+    if (stats.checkpoints) {
+        printf("checkpoints:   %llu written, avg %.2f ms, %.3f%% of the run time\n",
+                (unsigned long long)stats.checkpoints,
+                stats.checkpoint_ns_total / 1e6 / stats.checkpoints,
+                100.0 * stats.checkpoint_ns_total / (platform_time_ns() - stats.main_start_ns));
+    }
+
+    if (stats.switches) {
+        printf("launcher:      %llu switches, max %.2f us until the next rom is on screen\n",
+                (unsigned long long)stats.switches, stats.switch_ns_max / 1e3);
+    }
+
+    if (stats.runahead_frames) {
+        printf("runahead:      %llu frames, avg %.2f us overhead per frame\n",
+                (unsigned long long)stats.runahead_frames,
+                stats.frames ? stats.runahead_ns_total / 1000.0 / stats.frames : 0.0);
+    }
+
+    if (stats.governed_frames) {
+        printf("governor:      avg %.1f instructions per frame, idle in %.1f%% of frames\n",
+                (double)stats.governed_budget_total / stats.governed_frames,
+                100.0 * stats.idle_frames / stats.governed_frames);
+    }
+
+    if (stats.rollbacks || stats.netplay_stalls) {
+        printf("rollback:      %llu rollbacks, %llu frames resimulated, max %.2f us, %llu stalled frames\n",
+                (unsigned long long)stats.rollbacks,
+                (unsigned long long)stats.rollback_frames,
+                stats.rollback_ns_max / 1000.0,
+                (unsigned long long)stats.netplay_stalls);
+    }
+
+    if (c->tiered) {
+        printf("blocks:        %u compiled, %llu runs, %llu invalidated\n",
+                platform_atomic_load_u32(&c->tiered->compiled),
+                (unsigned long long)stats.block_runs,
+                (unsigned long long)stats.block_invalidations);
+        if (platform_atomic_load_u32(&c->tiered->dropped)) {
+            printf("               %u compile requests dropped, all %u blocks in use\n",
+                    platform_atomic_load_u32(&c->tiered->dropped), TIER_MAX_BLOCKS);
+        }
+        printf("ir:            %llu instructions eliminated (%.1f%% of instructions)\n",
+                (unsigned long long)stats.ir_eliminated,
+                stats.instructions ? 100.0 * stats.ir_eliminated / stats.instructions : 0.0);
+    }
+}
+
+// Scales the instructions per frame between min_ipf and max_ipf. Every frame
+// runs in slices until the ROM is seen idling, the budget then settles on the
+// busy part plus headroom and grows quickly while no idle slice is left
+typedef struct {
+    uint32_t   ipf;
+    uint32_t   min_ipf;
+    uint32_t   max_ipf;
+} Governor;
+
+static inline
+void governor_run_frame(Governor *g, Chip8 *c) {
+    const uint32_t budget = g->ipf;
+    const uint32_t slice = (budget + GOVERNOR_SLICES - 1) / GOVERNOR_SLICES;
+    uint32_t retired = 0;
+    uint32_t busy = 0;
+
+    c->idle = 0;
+    c->poll.pc = 0;
+
+    while (retired < budget) {
+        // once idle was seen the rest of the frame needs no more slicing
+        const uint32_t count = busy || budget - retired < slice ? budget - retired : slice;
+        const uint32_t ran = chip8_run_probed(c, count, 1);
+        retired += ran;
+
+        if (c->idle && !busy)
+            busy = retired;
+
+        // a draw ended the frame under QUIRK_DISPLAY_WAIT
+        if (ran < count || (c->config.quirks & QUIRK_DISPLAY_WAIT && c->drawn))
+            break;
+    }
+
+    stats.governed_frames++;
+    stats.governed_budget_total += budget;
+    stats.idle_frames += busy != 0;
+
+    if (!busy) {
+        g->ipf += g->ipf / 2 + 1;
+    } else {
+        const uint32_t target = busy + busy / GOVERNOR_HEADROOM_DIV;
+        if (target < g->ipf)
+            g->ipf -= (g->ipf - target + GOVERNOR_SMOOTHING - 1) / GOVERNOR_SMOOTHING;
+    }
+
+    g->ipf = g->ipf < g->min_ipf ? g->min_ipf : g->ipf > g->max_ipf ? g->max_ipf : g->ipf;
+}
+
+static inline
+void chip8_run_timed(Chip8 *c, Governor *g, uint32_t instruction_count) {
+    const uint64_t start = platform_time_ns();
+    if (g)
+        governor_run_frame(g, c);
+    else
+        chip8_run(c, instruction_count);
+    const uint64_t elapsed = platform_time_ns() - start;
+
+    stats.batch_ns_total += elapsed;
+    stats.batch_ns_max = elapsed > stats.batch_ns_max ? elapsed : stats.batch_ns_max;
+    stats.frames++;
+    latency_record(LATENCY_BATCH, elapsed);
+}
+
+// Emulates frames ahead with the current keys, renders the future frame when
+// asked to and rewinds. Speculative frames are not counted as emulated work
+static inline
+void chip8_run_ahead(Chip8 *c, Chip8 *snapshot, uint32_t instructions_per_frame, int render) {
+    const uint64_t start = platform_time_ns();
+    const Stats real = stats;
+    Profile *profile = c->profile;
+    DrawStream *draws = c->draws;
+
+    chip8_save(snapshot, c);
+    c->profile = NULL;
+    c->draws = NULL;
+    for (uint32_t frame = 0; frame < c->config.runahead; ++frame) {
+        chip8_run(c, instructions_per_frame);
+        chip8_update_timers(c);
+    }
+    c->profile = profile;
+    c->draws = draws;
+
+    if (render)
+        chip8_display(c);
+    chip8_restore(c, snapshot);
+
+    stats = real;
+    stats.runahead_frames += c->config.runahead;
+    stats.runahead_ns_total += platform_time_ns() - start;
+}
+
+typedef struct {
+    uint16_t   addr;
+    uint8_t    value;
+} Freeze;
+
+// Narrows down the addresses of a value the ROM keeps in memory. Commands are
+// read a line at a time from a file that may still be growing, one batch per
+// frame, and results go to stderr so they do not mix with the display
+typedef struct {
+    FILE      *commands;
+    char       line[MEMSEARCH_LINE_SIZE];
+    size_t     line_len;
+    uint32_t   wait_frames;
+    uint8_t    prev[MEM_SIZE];
+    uint8_t    candidates[MEM_SIZE];    // 0xFF while the address still matches
+    Freeze     freezes[MEMSEARCH_MAX_FREEZES];
+    uint32_t   freeze_count;
+} MemSearch;
+
+typedef enum {
+    SEARCH_EQ,
+    SEARCH_NE,
+    SEARCH_INC,
+    SEARCH_DEC,
+    SEARCH_SAME,
+    SEARCH_CHANGED,
+} SearchKind;
+
+// Branch free byte masks over the whole memory, which the compiler turns into
+// vector compares (AVX2 when built with -mavx2 or -march=native)
+static inline
+uint32_t memsearch_filter(MemSearch *ms, const uint8_t *mem, SearchKind kind, uint8_t value) {
+    uint8_t *candidates = ms->candidates;
+    const uint8_t *prev = ms->prev;
+
+    switch (kind) {
+    case SEARCH_EQ:
+        for (uint32_t a = 0; a < MEM_SIZE; ++a)
+            candidates[a] &= -(uint8_t)(mem[a] == value);
+        break;
+    case SEARCH_NE:
+        for (uint32_t a = 0; a < MEM_SIZE; ++a)
+            candidates[a] &= -(uint8_t)(mem[a] != value);
+        break;
+    case SEARCH_INC:
+        for (uint32_t a = 0; a < MEM_SIZE; ++a)
+            candidates[a] &= -(uint8_t)(mem[a] > prev[a]);
+        break;
+    case SEARCH_DEC:
+        for (uint32_t a = 0; a < MEM_SIZE; ++a)
+            candidates[a] &= -(uint8_t)(mem[a] < prev[a]);
+        break;
+    case SEARCH_SAME:
+        for (uint32_t a = 0; a < MEM_SIZE; ++a)
+            candidates[a] &= -(uint8_t)(mem[a] == prev[a]);
+        break;
+    case SEARCH_CHANGED:
+        for (uint32_t a = 0; a < MEM_SIZE; ++a)
+            candidates[a] &= -(uint8_t)(mem[a] != prev[a]);
+        break;
+    }
+
+    memcpy(ms->prev, mem, MEM_SIZE);
+
+    uint32_t count = 0;
+    for (uint32_t a = 0; a < MEM_SIZE; ++a)
+        count += candidates[a] & 1;
+    return count;
+}
+
+static inline
+void memsearch_list(const MemSearch *ms, const uint8_t *mem) {
+    uint32_t listed = 0;
+    for (uint32_t a = 0; a < MEM_SIZE && listed < MEMSEARCH_MAX_LIST; ++a) {
+        if (ms->candidates[a]) {
+            fprintf(stderr, "memsearch:   0x%03X = %u\n", a, mem[a]);
+            listed++;
+        }
+    }
+}
+
+static inline
+void memsearch_freeze(MemSearch *ms, uint16_t addr, uint8_t value) {
+    uint32_t k = 0;
+    while (k < ms->freeze_count && ms->freezes[k].addr != addr)
+        k++;
+
+    if (k == MEMSEARCH_MAX_FREEZES) {
+        fprintf(stderr, "memsearch: at most %u freezes\n", MEMSEARCH_MAX_FREEZES);
+        return;
+    }
+
+    ms->freezes[k] = (Freeze) { .addr = addr, .value = value };
+    ms->freeze_count += k == ms->freeze_count;
+}
+
+static inline
+void memsearch_unfreeze(MemSearch *ms, uint16_t addr) {
+    for (uint32_t k = 0; k < ms->freeze_count; ++k) {
+        if (ms->freezes[k].addr == addr) {
+            ms->freezes[k] = ms->freezes[--ms->freeze_count];
+            return;
+        }
+    }
+}
+
+static inline
+void memsearch_execute(MemSearch *ms, Chip8 *c, char *line) {
+    const char *cmd = strtok(line, " \t\r\n");
+    const char *arg1 = strtok(NULL, " \t\r\n");
+    const char *arg2 = strtok(NULL, " \t\r\n");
+    const uint32_t a = arg1 ? strtoul(arg1, NULL, 0) : 0;
+    const uint32_t b = arg2 ? strtoul(arg2, NULL, 0) : 0;
+
+    static const struct {
+        const char  *name;
+        SearchKind   kind;
+        int          takes_value;
+    } searches[] = {
+        { "eq",      SEARCH_EQ,      1 },
+        { "ne",      SEARCH_NE,      1 },
+        { "inc",     SEARCH_INC,     0 },
+        { "dec",     SEARCH_DEC,     0 },
+        { "same",    SEARCH_SAME,    0 },
+        { "changed", SEARCH_CHANGED, 0 },
+    };
+
+    if (!cmd)
+        return;
+
+    for (size_t k = 0; k < sizeof(searches)/sizeof(searches[0]); ++k) {
+        if (strcmp(cmd, searches[k].name))
+            continue;
+
+        if (searches[k].takes_value && !arg1) {
+            fprintf(stderr, "memsearch: %s needs a value\n", cmd);
+            return;
+        }
+
+        const uint32_t count = memsearch_filter(ms, c->mem, searches[k].kind, a);
+        fprintf(stderr, "memsearch: %s: %u candidates\n", cmd, count);
+        if (count <= MEMSEARCH_MAX_LIST)
+            memsearch_list(ms, c->mem);
+        return;
+    }
+
+    if (!strcmp(cmd, "reset")) {
+        memset(ms->candidates, 0xFF, MEM_SIZE);
+        memcpy(ms->prev, c->mem, MEM_SIZE);
+        fprintf(stderr, "memsearch: reset: %u candidates\n", MEM_SIZE);
+    } else if (!strcmp(cmd, "snap")) {
+        memcpy(ms->prev, c->mem, MEM_SIZE);
+    } else if (!strcmp(cmd, "list")) {
+        memsearch_list(ms, c->mem);
+    } else if (!strcmp(cmd, "freeze") && arg2 && a < MEM_SIZE) {
+        memsearch_freeze(ms, a, b);
+    } else if (!strcmp(cmd, "unfreeze") && arg1) {
+        memsearch_unfreeze(ms, a);
+    } else if (!strcmp(cmd, "wait") && arg1) {
+        ms->wait_frames = a;
+    } else {
+        fprintf(stderr, "memsearch: unknown command: %s\n", cmd);
+    }
+}
+
+static inline
+void memsearch_start(MemSearch *ms, const Chip8 *c, const char *path) {
+    if (!(ms->commands = fopen(path, "r")))
+        FATAL("Failed to open memory search commands: %s", path);
+
+    memset(ms->candidates, 0xFF, MEM_SIZE);
+    memcpy(ms->prev, c->mem, MEM_SIZE);
+}
+
+// Runs the commands that arrived since the last frame, a "wait <frames>" stops
+// reading for that many frames so a script can let the ROM play in between
+static inline
+void memsearch_update(MemSearch *ms, Chip8 *c) {
+    if (ms->wait_frames) {
+        ms->wait_frames--;
+        return;
+    }
+
+    int ch;
+    while (!ms->wait_frames && (ch = fgetc(ms->commands)) != EOF) {
+        if (ch != '\n') {
+            ms->line_len += ms->line_len < MEMSEARCH_LINE_SIZE - 1;
+            ms->line[ms->line_len - 1] = ch;
+            continue;
+        }
+        ms->line[ms->line_len] = '\0';
+        ms->line_len = 0;
+        memsearch_execute(ms, c, ms->line);
+    }
+
+    // more lines may be appended later
+    clearerr(ms->commands);
+}
+
+static inline
+void memsearch_apply_freezes(const MemSearch *ms, Chip8 *c) {
+    for (uint32_t k = 0; k < ms->freeze_count; ++k)
+        chip8_poke(c, ms->freezes[k].addr, ms->freezes[k].value);
+}
+
+// Header, then block_count unique ARCHIVE_BLOCK_SIZE chunks of memory, then
+// state_count fixed size records. A state is rebuilt in O(1) from its record
+// and the blocks it points at, so archives are read straight from a mapping
+typedef struct {
+    char       magic[4];
+    uint32_t   version;
+    uint32_t   state_count;
+    uint32_t   block_count;
+    uint64_t   blocks_offset;
+    uint64_t   states_offset;
+} ArchiveHeader;
+
+typedef struct {
+    uint32_t   blocks[ARCHIVE_STATE_BLOCKS];
+    uint16_t   pc;
+    uint16_t   i;
+    uint16_t   stack[STACK_SIZE];
+    uint8_t    sp;
+    uint8_t    delay_timer;
+    uint8_t    sound_timer;
+    uint8_t    reserved;
+    uint8_t    v[REG_COUNT];
+    uint8_t    display[DISPLAY_SIZE];
+    uint32_t   rng;
+    KeyStates  key_wait;
+} ArchivedState;
+
+// blocks are identified by two independent 64 bit hashes
+typedef struct {
+    uint64_t   hash[2];
+    uint32_t   block;           // block index + 1, 0 is an empty slot
+} ArchiveSlot;
+
+// Blocks go to the archive file as they are first seen and records to a
+// temporary stream that is appended on close. Safe to share between threads
+typedef struct {
+    FILE            *file;
+    FILE            *states;
+    const char      *path;
+    char             tmp_path[TCACHE_PATH_SIZE + 4];
+    ArchiveHeader    header;
+    PlatformMutex    lock;
+    ArchiveSlot     *index;         // ARCHIVE_INDEX_SIZE slots, mapped while the archive is open
+} ArchiveWriter;
+
+static inline
+void archive_hash_block(const uint8_t *block, uint64_t hash[2]) {
+    hash[0] = hash_bytes(block, ARCHIVE_BLOCK_SIZE);
+    hash[1] = 0;
+
+    uint64_t word;
+    for (uint32_t k = 0; k < ARCHIVE_BLOCK_SIZE; k += sizeof(word)) {
+        memcpy(&word, &block[k], sizeof(word));
+        hash[1] = (hash[1] ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash[1] ^= hash[1] >> 29;
+    }
+}
+
+static inline
+void archive_open(ArchiveWriter *a, const char *path) {
+    a->path = path;
+    snprintf(a->tmp_path, sizeof(a->tmp_path), "%s.tmp", path);
+
+    if (!(a->file = fopen(a->tmp_path, "wb")) || !(a->states = tmpfile()))
+        FATAL("Failed to create savestate archive: %s", a->tmp_path);
+
+    ArenaPages pages;
+    if (!(a->index = platform_map_arena(ARCHIVE_INDEX_SIZE * sizeof(ArchiveSlot), 0, &pages)))
+        FATAL("Failed to map the savestate archive index");
+
+    memcpy(a->header.magic, ARCHIVE_MAGIC, sizeof(a->header.magic));
+    a->header.version = ARCHIVE_VERSION;
+    a->header.blocks_offset = sizeof(a->header);
+    fwrite(&a->header, sizeof(a->header), 1, a->file);
+    platform_mutex_init(&a->lock);
+}
+
+// returns the index of an identical block, writing it first if it is new
+static inline
+uint32_t archive_intern_block(ArchiveWriter *a, const uint8_t *block) {
+    uint64_t hash[2];
+    archive_hash_block(block, hash);
+
+    uint32_t k = hash[0] & (ARCHIVE_INDEX_SIZE - 1);
+    while (a->index[k].block) {
+        if (a->index[k].hash[0] == hash[0] && a->index[k].hash[1] == hash[1])
+            return a->index[k].block - 1;
+        k = (k + 1) & (ARCHIVE_INDEX_SIZE - 1);
+    }
+
+    if (a->header.block_count == ARCHIVE_MAX_BLOCKS)
+        FATAL("Savestate archive is full: %u unique blocks", ARCHIVE_MAX_BLOCKS);
+
+    fwrite(block, ARCHIVE_BLOCK_SIZE, 1, a->file);
+    a->index[k] = (ArchiveSlot) { .hash = { hash[0], hash[1] }, .block = ++a->header.block_count };
+    return a->header.block_count - 1;
+}
+
+static inline
+void archive_add(ArchiveWriter *a, const Chip8 *c) {
+    ArchivedState state = {
+        .pc = c->pc,
+        .i = c->i,
+        .sp = c->sp,
+        .delay_timer = c->delay_timer,
+        .sound_timer = c->sound_timer,
+        .rng = c->rng,
+        .key_wait = c->key_wait,
+    };
+    memcpy(state.stack, c->stack, sizeof(state.stack));
+    memcpy(state.v, c->v, sizeof(state.v));
+    memcpy(state.display, c->display, sizeof(state.display));
+
+    platform_mutex_lock(&a->lock);
+    for (uint32_t b = 0; b < ARCHIVE_STATE_BLOCKS; ++b)
+        state.blocks[b] = archive_intern_block(a, &c->mem[b * ARCHIVE_BLOCK_SIZE]);
+    fwrite(&state, sizeof(state), 1, a->states);
+    a->header.state_count++;
+    platform_mutex_unlock(&a->lock);
+}
+
+static inline
+void archive_print_ratio(const char *path, uint32_t state_count, uint32_t block_count, uint64_t size) {
+    const uint64_t raw = (uint64_t)state_count * (MEM_SIZE + sizeof(ArchivedState) - sizeof(((ArchivedState *)0)->blocks));
+    printf("archive: %s: %u states, %u unique blocks of %llu, %llu bytes (%.1fx smaller than plain states)\n",
+            path, state_count, block_count,
+            (unsigned long long)state_count * ARCHIVE_STATE_BLOCKS,
+            (unsigned long long)size,
+            size ? (double)raw / size : 0.0);
+}
+
+static inline
+void archive_close(ArchiveWriter *a) {
+    a->header.states_offset = sizeof(a->header) + (uint64_t)a->header.block_count * ARCHIVE_BLOCK_SIZE;
+
+    uint8_t buffer[BUFSIZ];
+    size_t n;
+    rewind(a->states);
+    while ((n = fread(buffer, 1, sizeof(buffer), a->states)))
+        fwrite(buffer, 1, n, a->file);
+
+    fseek(a->file, 0, SEEK_SET);
+    fwrite(&a->header, sizeof(a->header), 1, a->file);
+
+    const int written = !ferror(a->file) && !ferror(a->states);
+    fclose(a->states);
+    fclose(a->file);
+    platform_mutex_destroy(&a->lock);
+    platform_unmap_arena(a->index, ARCHIVE_INDEX_SIZE * sizeof(ArchiveSlot));
+    a->index = NULL;
+
+    if (!written || !platform_replace_file(a->tmp_path, a->path)) {
+        fprintf(stderr, "archive: failed to write %s\n", a->path);
+        return;
+    }
+
+    archive_print_ratio(a->path, a->header.state_count, a->header.block_count,
+            a->header.states_offset + (uint64_t)a->header.state_count * sizeof(ArchivedState));
+}
+
+// Maps an archive, NULL when it is missing or malformed
+static inline
+const ArchiveHeader *archive_map(const char *path, size_t *size) {
+    const ArchiveHeader *header = platform_map_file(path, size);
+    if (!header)
+        return NULL;
+
+    const int valid = *size >= sizeof(*header) &&
+        !memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) &&
+        header->version == ARCHIVE_VERSION &&
+        header->blocks_offset + (uint64_t)header->block_count * ARCHIVE_BLOCK_SIZE <= header->states_offset &&
+        header->states_offset + (uint64_t)header->state_count * sizeof(ArchivedState) <= *size;
+
+    if (!valid) {
+        platform_unmap_file(header, *size);
+        return NULL;
+    }
+    return header;
+}
+
+// keeps the configuration and engines of c, fails on out of range block indices
+static inline
+int archive_load_state(const ArchiveHeader *header, uint32_t index, Chip8 *c) {
+    if (index >= header->state_count)
+        return 0;
+
+    const uint8_t *base = (const uint8_t *)header;
+    const ArchivedState *state = (const ArchivedState *)(base + header->states_offset) + index;
+    const uint8_t *blocks = base + header->blocks_offset;
+
+    for (uint32_t b = 0; b < ARCHIVE_STATE_BLOCKS; ++b) {
+        if (state->blocks[b] >= header->block_count)
+            return 0;
+    }
+
+    Chip8 *loaded = &(Chip8){0};
+    chip8_save(loaded, c);
+    for (uint32_t b = 0; b < ARCHIVE_STATE_BLOCKS; ++b)
+        memcpy(&loaded->mem[b * ARCHIVE_BLOCK_SIZE], &blocks[(size_t)state->blocks[b] * ARCHIVE_BLOCK_SIZE], ARCHIVE_BLOCK_SIZE);
+
+    loaded->pc = state->pc;
+    loaded->i = state->i;
+    loaded->sp = state->sp;
+    loaded->delay_timer = state->delay_timer;
+    loaded->sound_timer = state->sound_timer;
+    loaded->rng = state->rng;
+    loaded->key_wait = state->key_wait;
+    memcpy(loaded->stack, state->stack, sizeof(loaded->stack));
+    memcpy(loaded->v, state->v, sizeof(loaded->v));
+    memcpy(loaded->display, state->display, sizeof(loaded->display));
+
+    chip8_restore(c, loaded);
+    return 1;
+}
+
+// spec is "<archive>:<index>"
+static inline
+void archive_restore(Chip8 *c, const char *spec) {
+    char path[TCACHE_PATH_SIZE];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || (size_t)(colon - spec) >= sizeof(path))
+        FATAL("Expected <archive>:<index> for -state: %s", spec);
+
+    memcpy(path, spec, colon - spec);
+    path[colon - spec] = '\0';
+    const uint32_t index = strtoul(colon + 1, NULL, 10);
+
+    size_t size = 0;
+    const ArchiveHeader *header = archive_map(path, &size);
+    if (!header)
+        FATAL("Not a savestate archive: %s", path);
+
+    if (!archive_load_state(header, index, c))
+        FATAL("No state %u in %s (%u states)", index, path, header->state_count);
+
+    platform_unmap_file(header, size);
+    printf("archive: restored state %u of %s\n", index, path);
+}
+
+static inline
+int archive_info(const char *path) {
+    size_t size = 0;
+    const ArchiveHeader *header = archive_map(path, &size);
+    if (!header)
+        FATAL("Not a savestate archive: %s", path);
+
+    archive_print_ratio(path, header->state_count, header->block_count, size);
+    platform_unmap_file(header, size);
+    return 0;
+}
+
+// path may be a FIFO a spectator reads from
+static inline
+void draw_stream_open(DrawStream *d, const char *path, uint32_t keyframe_frames, uint32_t frames_per_sec, int live) {
+    if (!(d->file = fopen(path, "wb")))
+        FATAL("Failed to create draw stream: %s", path);
+
+    d->path = path;
+    d->live = live;
+    d->keyframe_frames = keyframe_frames ? keyframe_frames : DRAW_DEFAULT_KEYFRAMES;
+    d->since_keyframe = d->keyframe_frames - 1;     // the first frame is a keyframe
+
+    DrawStreamHeader header = {
+        .version = DRAW_VERSION,
+        .width = DISPLAY_WIDTH * BYTE_SIZE,
+        .height = DISPLAY_HEIGHT,
+        .frames_per_sec = frames_per_sec,
+    };
+    memcpy(header.magic, DRAW_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, d->file);
+    d->bytes = sizeof(header);
+}
+
+// Applies the commands of a frame, returns 0 when they are malformed
+static inline
+int draw_apply(uint8_t *display, const uint8_t *commands, uint32_t length, uint64_t *collision_mismatches) {
+    for (uint32_t k = 0; k < length;) {
+        switch (commands[k]) {
+        case DRAW_CLEAR:
+            memset(display, 0, DISPLAY_SIZE);
+            k += 1;
+            break;
+        case DRAW_SPRITE: {
+            if (k + 4 > length)
+                return 0;
+            const uint8_t x = commands[k+1], y = commands[k+2];
+            const uint8_t rows = commands[k+3] & ~DRAW_COLLISION;
+            if (k + 4 + rows > length || x >= DISPLAY_WIDTH * BYTE_SIZE || y >= DISPLAY_HEIGHT)
+                return 0;
+            const uint8_t vf = display_draw_sprite(display, x, y, &commands[k+4], rows);
+            if (collision_mismatches)
+                *collision_mismatches += !vf != !(commands[k+3] & DRAW_COLLISION);
+            k += 4 + rows;
+            break;
+        }
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline
+void draw_stream_write(DrawStream *d, const void *bytes, uint32_t count) {
+    fwrite(bytes, 1, count, d->file);
+    d->bytes += count;
+}
+
+// Ends the frame: its commands when they rebuild the display, else a resync
+static inline
+void draw_stream_frame(DrawStream *d, const Chip8 *c) {
+    const int exact = !d->overflow &&
+        d->length <= DISPLAY_SIZE &&
+        draw_apply(d->shadow, d->commands, d->length, NULL) &&
+        !memcmp(d->shadow, c->display, DISPLAY_SIZE);
+
+    if (exact) {
+        draw_stream_write(d, d->commands, d->length);
+        if (++d->since_keyframe >= d->keyframe_frames) {
+            draw_stream_write(d, (const uint8_t[]) { DRAW_KEYFRAME }, 1);
+            draw_stream_write(d, c->display, DISPLAY_SIZE);
+            d->since_keyframe = 0;
+            d->keyframes++;
+        }
+    } else {
+        // rolled back, restored or too busy a frame
+        draw_stream_write(d, (const uint8_t[]) { DRAW_RESYNC }, 1);
+        draw_stream_write(d, c->display, DISPLAY_SIZE);
+        memcpy(d->shadow, c->display, DISPLAY_SIZE);
+        d->since_keyframe = 0;
+        d->resyncs++;
+    }
+    draw_stream_write(d, (const uint8_t[]) { DRAW_END_FRAME }, 1);
+
+    d->length = 0;
+    d->overflow = 0;
+    d->frames++;
+    if (d->live)
+        fflush(d->file);
+}
+
+static inline
+void draw_stream_close(DrawStream *d) {
+    const int failed = ferror(d->file);
+    fclose(d->file);
+    if (failed) {
+        fprintf(stderr, "draw stream: failed to write %s\n", d->path);
+        return;
+    }
+
+    printf("draw stream: %llu frames, %llu sprites, %llu clears, %llu keyframes, %llu resyncs\n",
+            (unsigned long long)d->frames, (unsigned long long)d->sprites, (unsigned long long)d->clears,
+            (unsigned long long)d->keyframes, (unsigned long long)d->resyncs);
+    printf("draw stream: %llu bytes, %.1f per frame against %u for whole frames\n",
+            (unsigned long long)d->bytes, d->frames ? (double)d->bytes / d->frames : 0.0, DISPLAY_SIZE);
+}
+
+// Replays a draw stream the way a late joiner would, from its first keyframe at
+// or after join_frame, and checks every later keyframe and collision flag
+// against the rebuilt display
+static inline
+int draw_info(const char *path, uint64_t join_frame) {
+    size_t size = 0;
+    const uint8_t *data = platform_map_file(path, &size);
+    const DrawStreamHeader *header = (const DrawStreamHeader *)data;
+    if (!data || size < sizeof(*header) ||
+        memcmp(header->magic, DRAW_MAGIC, sizeof(header->magic)) ||
+        header->version != DRAW_VERSION ||
+        header->width != DISPLAY_WIDTH * BYTE_SIZE ||
+        header->height != DISPLAY_HEIGHT)
+        FATAL("Not a draw stream: %s", path);
+
+    static uint8_t display[DISPLAY_SIZE];
+    uint64_t frames = 0, joined_at = UINT64_MAX, keyframes = 0, keyframe_mismatches = 0,
+             resyncs = 0, collision_mismatches = 0;
+
+    size_t k = sizeof(*header);
+    while (k < size) {
+        // one frame: commands, an optional keyframe or resync, DRAW_END_FRAME
+        const size_t start = k;
+        while (k < size && data[k] != DRAW_END_FRAME && data[k] != DRAW_KEYFRAME && data[k] != DRAW_RESYNC)
+            k += data[k] == DRAW_SPRITE && k + 3 < size ? 4 + (data[k+3] & ~DRAW_COLLISION) : 1;
+        if (k >= size)
+            break;
+
+        if (joined_at != UINT64_MAX &&
+            !draw_apply(display, &data[start], k - start, &collision_mismatches))
+            FATAL("Malformed draw stream at byte %zu", start);
+
+        if (data[k] != DRAW_END_FRAME) {
+            if (k + 1 + DISPLAY_SIZE >= size)
+                break;
+            if (data[k] == DRAW_KEYFRAME) {
+                keyframes++;
+                keyframe_mismatches += joined_at != UINT64_MAX && memcmp(display, &data[k+1], DISPLAY_SIZE);
+            } else {
+                resyncs++;
+            }
+            if (joined_at == UINT64_MAX && frames >= join_frame)
+                joined_at = frames;
+            memcpy(display, &data[k+1], DISPLAY_SIZE);
+            k += 1 + DISPLAY_SIZE;
+        }
+        if (data[k] != DRAW_END_FRAME)
+            FATAL("Malformed draw stream at byte %zu", k);
+        k++;
+        frames++;
+    }
+
+    printf("%s: %llu frames in %zu bytes, %.1f per frame, %u fps\n", path,
+            (unsigned long long)frames, size, frames ? (double)size / frames : 0.0, header->frames_per_sec);
+    printf("%s: %llu keyframes, %llu resyncs, joined at frame %llu\n", path,
+            (unsigned long long)keyframes, (unsigned long long)resyncs,
+            (unsigned long long)(joined_at == UINT64_MAX ? 0 : joined_at));
+    printf("%s: %llu keyframes and %llu collision flags differ from the rebuilt display\n", path,
+            (unsigned long long)keyframe_mismatches, (unsigned long long)collision_mismatches);
+
+    platform_unmap_file(data, size);
+    return keyframe_mismatches || collision_mismatches;
+}
+
+typedef enum {
+    EXPR_CONST,
+    EXPR_MEM,
+    EXPR_V,
+    EXPR_I,
+    EXPR_PC,
+    EXPR_DELAY,
+    EXPR_ADD,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_NEG,
+} ExprKind;
+
+typedef struct {
+    ExprKind   kind;
+    int64_t    value;           // constant, memory address or register
+} ExprOp;
+
+// postfix form of a score expression like "mem[0x3F0] * 10 - v[2]"
+typedef struct {
+    ExprOp     ops[SEARCH_MAX_EXPR];
+    uint32_t   len;
+    const char *text;
+    const char *at;
+} Expr;
+
+static inline
+void expr_emit(Expr *e, ExprKind kind, int64_t value) {
+    if (e->len == SEARCH_MAX_EXPR)
+        FATAL("Search expression is too long: %s", e->text);
+    e->ops[e->len++] = (ExprOp) { .kind = kind, .value = value };
+}
+
+static inline
+void expr_skip_space(Expr *e) {
+    while (*e->at == ' ' || *e->at == '\t')
+        e->at++;
+}
+
+static inline
+int expr_accept(Expr *e, const char *token) {
+    expr_skip_space(e);
+    const size_t len = strlen(token);
+    if (strncmp(e->at, token, len))
+        return 0;
+    e->at += len;
+    return 1;
+}
+
+static inline
+int64_t expr_number(Expr *e) {
+    expr_skip_space(e);
+    char *end = NULL;
+    const int64_t value = strtoll(e->at, &end, 0);
+    if (end == e->at)
+        FATAL("Expected a number at '%s' in search expression: %s", e->at, e->text);
+    e->at = end;
+    return value;
+}
+
+static inline void expr_parse_sum(Expr *e);
+
+static inline
+void expr_parse_primary(Expr *e) {
+    if (expr_accept(e, "(")) {
+        expr_parse_sum(e);
+        if (!expr_accept(e, ")"))
+            FATAL("Missing ')' in search expression: %s", e->text);
+    } else if (expr_accept(e, "-")) {
+        expr_parse_primary(e);
+        expr_emit(e, EXPR_NEG, 0);
+    } else if (expr_accept(e, "mem[") || expr_accept(e, "v[")) {
+        const int mem = e->at[-2] == 'm';
+        const int64_t index = expr_number(e);
+        if (!expr_accept(e, "]") || index < 0 || index >= (mem ? MEM_SIZE : REG_COUNT))
+            FATAL("Bad %s index in search expression: %s", mem ? "mem" : "v", e->text);
+        expr_emit(e, mem ? EXPR_MEM : EXPR_V, index);
+    } else if (expr_accept(e, "pc")) {
+        expr_emit(e, EXPR_PC, 0);
+    } else if (expr_accept(e, "dt")) {
+        expr_emit(e, EXPR_DELAY, 0);
+    } else if (expr_accept(e, "i")) {
+        expr_emit(e, EXPR_I, 0);
+    } else {
+        expr_emit(e, EXPR_CONST, expr_number(e));
+    }
+}
+
+static inline
+void expr_parse_product(Expr *e) {
+    expr_parse_primary(e);
+    while (expr_accept(e, "*")) {
+        expr_parse_primary(e);
+        expr_emit(e, EXPR_MUL, 0);
+    }
+}
+
+static inline
+void expr_parse_sum(Expr *e) {
+    expr_parse_product(e);
+    while (1) {
+        if (expr_accept(e, "+")) {
+            expr_parse_product(e);
+            expr_emit(e, EXPR_ADD, 0);
+        } else if (expr_accept(e, "-")) {
+            expr_parse_product(e);
+            expr_emit(e, EXPR_SUB, 0);
+        } else {
+            return;
+        }
+    }
+}
+
+// terms are numbers, mem[n], v[n], i, pc and dt, combined with + - * and parentheses
+static inline
+void expr_compile(Expr *e, const char *text) {
+    *e = (Expr) { .text = text, .at = text };
+    expr_parse_sum(e);
+    expr_skip_space(e);
+    if (*e->at)
+        FATAL("Unexpected '%s' in search expression: %s", e->at, text);
+}
+
+static inline
+int64_t expr_eval(const Expr *e, const Chip8 *c) {
+    int64_t stack[SEARCH_MAX_EXPR];
+    uint32_t sp = 0;
+
+    for (uint32_t k = 0; k < e->len; ++k) {
+        const ExprOp *op = &e->ops[k];
+        switch (op->kind) {
+        case EXPR_CONST:    stack[sp++] = op->value;                    break;
+        case EXPR_MEM:      stack[sp++] = c->mem[op->value];            break;
+        case EXPR_V:        stack[sp++] = c->v[op->value];              break;
+        case EXPR_I:        stack[sp++] = c->i;                         break;
+        case EXPR_PC:       stack[sp++] = c->pc;                        break;
+        case EXPR_DELAY:    stack[sp++] = c->delay_timer;               break;
+        case EXPR_ADD:      sp--; stack[sp-1] += stack[sp];             break;
+        case EXPR_SUB:      sp--; stack[sp-1] -= stack[sp];             break;
+        case EXPR_MUL:      sp--; stack[sp-1] *= stack[sp];             break;
+        case EXPR_NEG:      stack[sp-1] = -stack[sp-1];                 break;
+        }
+    }
+    return stack[0];
+}
+
+// How a state was reached, the input path is rebuilt by following parent
+typedef struct {
+    uint32_t   parent;
+    uint16_t   frame;
+    uint8_t    action;          // key pressed, SEARCH_ACTIONS - 1 for none
+} SearchNode;
+
+typedef struct {
+    int64_t    score;
+    uint32_t   node;
+    uint32_t   slot;
+} SearchEntry;
+
+struct Search;
+
+// A max-heap of savestates by score. The owner pops its best state, idle
+// workers steal the best state of another worker under its lock
+typedef struct {
+    PlatformMutex    lock;
+    SearchEntry      heap[SEARCH_FRONTIER];
+    uint32_t         heap_len;
+    Chip8            states[SEARCH_FRONTIER];
+    uint32_t         free_slots[SEARCH_FRONTIER];
+    uint32_t         free_count;
+    Chip8            current;
+    Chip8            child;
+    PlatformThread   thread;
+    struct Search   *search;
+    uint64_t         expanded;
+    uint64_t         duplicates;
+    uint64_t         pruned;
+    uint64_t         stolen;
+} SearchWorker;
+
+typedef struct Search {
+    Expr             expr;
+    uint32_t         instructions_per_frame;
+    uint32_t         hold;
+    uint32_t         max_depth;
+    uint32_t         max_expansions;
+    KeyStates        keys;
+    uint32_t         expansions;
+    uint32_t         active;
+    uint32_t         node_count;
+    SearchNode       nodes[SEARCH_MAX_NODES];
+    uint64_t         seen[SEARCH_SEEN_SIZE];    // state hashes, 0 is an empty slot
+    PlatformMutex    best_lock;
+    int64_t          best_score;
+    uint32_t         best_node;
+    uint32_t         worker_count;
+    ArchiveWriter   *archive;                   // receives every unique state when set
+    SearchWorker     workers[SEARCH_MAX_WORKERS];
+} Search;
+
+static inline
+uint64_t search_mix(uint64_t hash, uint64_t value) {
+    hash = (hash ^ value) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+// the held keys are input rather than state and are left out
+static inline
+uint64_t search_hash(const Chip8 *c) {
+    uint64_t hash = 0;
+    uint64_t word;
+
+    for (uint32_t k = 0; k < MEM_SIZE; k += sizeof(word)) {
+        memcpy(&word, &c->mem[k], sizeof(word));
+        hash = search_mix(hash, word);
+    }
+    for (uint32_t k = 0; k < DISPLAY_SIZE; k += sizeof(word)) {
+        memcpy(&word, &c->display[k], sizeof(word));
+        hash = search_mix(hash, word);
+    }
+    for (uint32_t k = 0; k < REG_COUNT; k += sizeof(word)) {
+        memcpy(&word, &c->v[k], sizeof(word));
+        hash = search_mix(hash, word);
+    }
+    for (uint32_t k = 0; k < c->sp; ++k)
+        hash = search_mix(hash, c->stack[k]);
+
+    hash = search_mix(hash, (uint64_t)c->pc << 48 | (uint64_t)c->i << 32 | c->rng);
+    hash = search_mix(hash, (uint64_t)c->sp << 48 | (uint64_t)c->delay_timer << 40 |
+            (uint64_t)c->sound_timer << 32 | c->key_wait);
+    return hash ? hash : 1;
+}
+
+// returns 0 if the state was seen before
+static inline
+int search_mark_seen(Search *s, uint64_t hash) {
+    for (uint32_t probe = 0; probe < SEARCH_SEEN_SIZE; ++probe) {
+        const uint64_t found = platform_atomic_cas_u64(&s->seen[(hash + probe) & (SEARCH_SEEN_SIZE - 1)], 0, hash);
+        if (found == 0)
+            return 1;
+        if (found == hash)
+            return 0;
+    }
+    return 1;
+}
+
+static inline
+void search_heap_push(SearchWorker *w, SearchEntry entry) {
+    uint32_t k = w->heap_len++;
+    while (k && w->heap[(k - 1) / 2].score < entry.score) {
+        w->heap[k] = w->heap[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    w->heap[k] = entry;
+}
+
+static inline
+SearchEntry search_heap_pop(SearchWorker *w) {
+    const SearchEntry top = w->heap[0];
+    const SearchEntry last = w->heap[--w->heap_len];
+
+    uint32_t k = 0;
+    while (2 * k + 1 < w->heap_len) {
+        uint32_t child = 2 * k + 1;
+        if (child + 1 < w->heap_len && w->heap[child + 1].score > w->heap[child].score)
+            child++;
+        if (w->heap[child].score <= last.score)
+            break;
+        w->heap[k] = w->heap[child];
+        k = child;
+    }
+    w->heap[k] = last;
+    return top;
+}
+
+// returns 0 when the frontier is full and the state is dropped
+static inline
+int search_push(SearchWorker *w, const Chip8 *state, int64_t score, uint32_t node) {
+    platform_mutex_lock(&w->lock);
+    const int room = w->free_count != 0;
+    if (room) {
+        const uint32_t slot = w->free_slots[--w->free_count];
+        chip8_save(&w->states[slot], state);
+        search_heap_push(w, (SearchEntry) { .score = score, .node = node, .slot = slot });
+    }
+    platform_mutex_unlock(&w->lock);
+    return room;
+}
+
+static inline
+int search_pop(SearchWorker *from, Chip8 *state, uint32_t *node) {
+    platform_mutex_lock(&from->lock);
+    const int found = from->heap_len != 0;
+    if (found) {
+        const SearchEntry entry = search_heap_pop(from);
+        chip8_save(state, &from->states[entry.slot]);
+        from->free_slots[from->free_count++] = entry.slot;
+        *node = entry.node;
+    }
+    platform_mutex_unlock(&from->lock);
+    return found;
+}
+
+static inline
+int search_steal(Search *s, SearchWorker *w, Chip8 *state, uint32_t *node) {
+    const uint32_t self = w - s->workers;
+    for (uint32_t k = 1; k < s->worker_count; ++k) {
+        if (search_pop(&s->workers[(self + k) % s->worker_count], state, node)) {
+            w->stolen++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline
+int search_frontier_empty(Search *s) {
+    for (uint32_t k = 0; k < s->worker_count; ++k) {
+        if (platform_atomic_load_u32(&s->workers[k].heap_len))
+            return 0;
+    }
+    return 1;
+}
+
+static inline
+void search_note_best(Search *s, int64_t score, uint32_t node) {
+    platform_mutex_lock(&s->best_lock);
+    if (score > s->best_score || (score == s->best_score && s->nodes[node].frame < s->nodes[s->best_node].frame)) {
+        s->best_score = score;
+        s->best_node = node;
+    }
+    platform_mutex_unlock(&s->best_lock);
+}
+
+// every allowed input is held for s->hold frames from the expanded state
+static inline
+void search_expand(Search *s, SearchWorker *w, uint32_t node) {
+    const uint32_t frame = s->nodes[node].frame + s->hold;
+    if (frame > s->max_depth)
+        return;
+
+    for (uint8_t action = 0; action < SEARCH_ACTIONS; ++action) {
+        const int none = action == SEARCH_ACTIONS - 1;
+        if (!none && !KEY_DOWN(s->keys, action))
+            continue;
+
+        Chip8 *child = &w->child;
+        chip8_save(child, &w->current);
+        child->keys = none ? 0 : KEY_FLAG(action);
+        for (uint32_t f = 0; f < s->hold; ++f) {
+            chip8_interpret(child, s->instructions_per_frame);
+            chip8_update_timers(child);
+        }
+
+        if (!search_mark_seen(s, search_hash(child))) {
+            w->duplicates++;
+            continue;
+        }
+
+        const uint32_t id = platform_atomic_add_u32(&s->node_count, 1);
+        if (id >= SEARCH_MAX_NODES) {
+            w->pruned++;
+            continue;
+        }
+        s->nodes[id] = (SearchNode) { .parent = node, .frame = frame, .action = action };
+        if (s->archive)
+            archive_add(s->archive, child);
+
+        const int64_t score = expr_eval(&s->expr, child);
+        search_note_best(s, score, id);
+
+        if (!search_push(w, child, score, id))
+            w->pruned++;
+    }
+}
+
+static
+THREAD_FUNC(search_worker_thread) {
+    SearchWorker *w = arg;
+    Search *s = w->search;
+
+    while (platform_atomic_load_u32(&s->expansions) < s->max_expansions) {
+        // counted as active before taking work, so an empty frontier with no
+        // active worker means nothing can be queued anymore
+        platform_atomic_add_u32(&s->active, 1);
+
+        uint32_t node;
+        if (!search_pop(w, &w->current, &node) && !search_steal(s, w, &w->current, &node)) {
+            platform_atomic_add_u32(&s->active, -1);
+            if (!platform_atomic_load_u32(&s->active) && search_frontier_empty(s))
+                break;
+            platform_sleep(1);
+            continue;
+        }
+
+        if (platform_atomic_add_u32(&s->expansions, 1) >= s->max_expansions) {
+            platform_atomic_add_u32(&s->active, -1);
+            break;
+        }
+        w->expanded++;
+        search_expand(s, w, node);
+        platform_atomic_add_u32(&s->active, -1);
+    }
+
+    THREAD_RETURN;
+}
+
+// Best-first search over key inputs from the loaded state, scored by expr.
+// Runs the plain interpreter on every core and prints the best input sequence
+static inline
+int search_run(const Chip8 *c, const char *expr, uint32_t instructions_per_frame, ArchiveWriter *archive) {
+    // far too large for the stack, and only --search needs it
+    ArenaPages pages;
+    Search *s = platform_map_arena(sizeof(Search), 0, &pages);
+    if (!s)
+        FATAL("Failed to map %zu bytes of search state", sizeof(Search));
+    s->archive = archive;
+
+    expr_compile(&s->expr, expr);
+    s->instructions_per_frame = instructions_per_frame;
+    s->hold = c->config.search_hold ? c->config.search_hold : SEARCH_DEFAULT_HOLD;
+    s->max_depth = c->config.search_depth ? c->config.search_depth : SEARCH_DEFAULT_DEPTH;
+    s->max_expansions = c->config.search_nodes ? c->config.search_nodes : SEARCH_DEFAULT_NODES;
+    s->keys = c->config.search_keys ? c->config.search_keys : 0xFFFF;
+
+    if (s->max_depth > UINT16_MAX)
+        FATAL("-search-depth can be at most %u frames", UINT16_MAX);
+    if ((uint64_t)s->max_expansions * SEARCH_ACTIONS > SEARCH_MAX_NODES)
+        FATAL("-search-nodes can be at most %u", SEARCH_MAX_NODES / SEARCH_ACTIONS);
+
+    const uint32_t cpus = platform_cpu_count();
+    s->worker_count = cpus < SEARCH_MAX_WORKERS ? cpus : SEARCH_MAX_WORKERS;
+
+    for (uint32_t k = 0; k < s->worker_count; ++k) {
+        SearchWorker *w = &s->workers[k];
+        platform_mutex_init(&w->lock);
+        w->search = s;
+        for (uint32_t slot = 0; slot < SEARCH_FRONTIER; ++slot)
+            w->free_slots[w->free_count++] = slot;
+    }
+    platform_mutex_init(&s->best_lock);
+
+    // root is the loaded state, run by the interpreter only
+    Chip8 *root = &s->workers[0].child;
+    chip8_save(root, c);
+    root->profile = NULL;
+    root->predecode = NULL;
+    root->tiered = NULL;
+    root->draws = NULL;
+
+    s->nodes[0] = (SearchNode) { .parent = UINT32_MAX, .action = SEARCH_ACTIONS - 1 };
+    s->node_count = 1;
+    s->best_score = expr_eval(&s->expr, root);
+    search_mark_seen(s, search_hash(root));
+    if (s->archive)
+        archive_add(s->archive, root);
+    search_push(&s->workers[0], root, s->best_score, 0);
+
+    printf("search: %u workers, %u expansions of %u frames up to frame %u, score: %s\n",
+            s->worker_count, s->max_expansions, s->hold, s->max_depth, expr);
+
+    // the log ring takes a single producer, workers do not log
+    const LogLevel level = log_level;
+    log_level = LOG_OFF;
+
+    const uint64_t start = platform_time_ns();
+    for (uint32_t k = 0; k < s->worker_count; ++k) {
+        if (!platform_thread_start(&s->workers[k].thread, search_worker_thread, &s->workers[k]))
+            FATAL("Failed to start search worker");
+    }
+
+    // idle workers may still steal from a finished one until all are done
+    for (uint32_t k = 0; k < s->worker_count; ++k)
+        platform_thread_join(s->workers[k].thread);
+    log_level = level;
+
+    uint64_t expanded = 0, duplicates = 0, pruned = 0, stolen = 0;
+    for (uint32_t k = 0; k < s->worker_count; ++k) {
+        SearchWorker *w = &s->workers[k];
+        platform_mutex_destroy(&w->lock);
+        expanded += w->expanded;
+        duplicates += w->duplicates;
+        pruned += w->pruned;
+        stolen += w->stolen;
+    }
+    platform_mutex_destroy(&s->best_lock);
+
+    const double seconds = (platform_time_ns() - start) / 1e9;
+    const uint32_t states = s->node_count < SEARCH_MAX_NODES ? s->node_count : SEARCH_MAX_NODES;
+    printf("search: %llu expanded, %u unique states, %llu duplicates, %llu dropped, %llu stolen\n",
+            (unsigned long long)expanded, states,
+            (unsigned long long)duplicates,
+            (unsigned long long)pruned,
+            (unsigned long long)stolen);
+    printf("search: %.2f s, %.0f expansions/s, %.0f emulated frames/s\n",
+            seconds, expanded / seconds,
+            (double)(expanded * SEARCH_ACTIONS * s->hold) / seconds);
+    printf("search: best score %lld at frame %u\n",
+            (long long)s->best_score, s->nodes[s->best_node].frame);
+
+    // the path is stored leaf to root
+    uint8_t path[UINT16_MAX];
+    uint32_t len = 0;
+    for (uint32_t n = s->best_node; n != 0; n = s->nodes[n].parent)
+        path[len++] = s->nodes[n].action;
+
+    printf("search: keys held %u frames each, - for none:", s->hold);
+    while (len--)
+        printf(path[len] == SEARCH_ACTIONS - 1 ? " -" : " %X", path[len]);
+    printf("\n");
+
+    if (s->archive)
+        archive_close(s->archive);
+
+    platform_unmap_arena(s, sizeof(Search));
+    return 0;
+}
+
+typedef enum {
+    YIELD_FRAME_END,
+    YIELD_DISPLAY_WAIT,         // drew under QUIRK_DISPLAY_WAIT
+    YIELD_IDLE,                 // in FX07; 3X00; 1NNN until the delay timer runs out
+    YIELD_KEY_WAIT,             // blocked in FX0A
+    YIELD_HALTED,               // jumped to itself
+    YIELD_REASON_COUNT,
+} YieldReason;
+
+static const char *const YIELD_REASON_NAMES[] = {
+    [YIELD_FRAME_END]       = "frame end",
+    [YIELD_DISPLAY_WAIT]    = "display wait",
+    [YIELD_IDLE]            = "idle",
+    [YIELD_KEY_WAIT]        = "key wait",
+    [YIELD_HALTED]          = "halted",
+};
+
+// An instance resumes for at most one frame and then yields. Parked instances
+// are in no list at all, their skipped frames only ever change the timers.
+// Sleeping ones spent their skipped frames in a timer wait loop
+typedef struct {
+    Chip8      chip8;
+    uint32_t   frame;           // frames run or skipped, the timers are current up to here
+    uint32_t   next;            // link in the ready queue or a wheel slot
+    uint8_t    parked;
+} Instance;
+
+// Multiplexes instances on the calling thread. Instances due at a tick sit in
+// the wheel slot of that tick and move to the ready queue when the tick starts
+typedef struct {
+    Instance  *instances[SCHED_MAX_INSTANCES];
+    uint32_t   count;
+    uint32_t   tick;
+    uint32_t   instructions_per_frame;
+    uint32_t   ready_head;
+    uint32_t   ready_tail;
+    uint32_t   wheel[SCHED_WHEEL_SIZE];
+    uint64_t   resumes;
+    uint64_t   yields[YIELD_REASON_COUNT];
+} Scheduler;
+
+static inline
+void scheduler_make_ready(Scheduler *s, uint32_t id) {
+    s->instances[id]->next = SCHED_NONE;
+    if (s->ready_head == SCHED_NONE)
+        s->ready_head = id;
+    else
+        s->instances[s->ready_tail]->next = id;
+    s->ready_tail = id;
+}
+
+// ticks is at least 1 and below SCHED_WHEEL_SIZE
+static inline
+void scheduler_sleep(Scheduler *s, uint32_t id, uint32_t ticks) {
+    const uint32_t slot = (s->tick + ticks) & (SCHED_WHEEL_SIZE - 1);
+    s->instances[id]->next = s->wheel[slot];
+    s->wheel[slot] = id;
+}
+
+static inline
+void scheduler_init(Scheduler *s, uint32_t instructions_per_frame) {
+    s->count = 0;
+    s->tick = 0;
+    s->instructions_per_frame = instructions_per_frame;
+    s->ready_head = s->ready_tail = SCHED_NONE;
+    for (uint32_t slot = 0; slot < SCHED_WHEEL_SIZE; ++slot)
+        s->wheel[slot] = SCHED_NONE;
+    s->resumes = 0;
+    memset(s->yields, 0, sizeof(s->yields));
+}
+
+// Returns the id of the instance. It keeps its frame and stays parked if it
+// was, otherwise it runs from the current tick on
+static inline
+uint32_t scheduler_add(Scheduler *s, Instance *in) {
+    if (s->count == SCHED_MAX_INSTANCES)
+        FATAL("More than %u scheduled instances", SCHED_MAX_INSTANCES);
+
+    const uint32_t id = s->count++;
+    s->instances[id] = in;
+    if (!in->parked)
+        scheduler_make_ready(s, id);
+    return id;
+}
+
+// Returns the address of the FX07 when pc is in FX07; 3X00; 1NNN jumping back
+// to it, a loop that only ends once the delay timer read 0. 0 otherwise
+static inline
+uint16_t timer_wait_loop(const Chip8 *c) {
+    for (uint16_t back = 0; back <= 4 && back <= c->pc; back += 2) {
+        const uint16_t addr = c->pc - back;
+        if (addr + 6 > MEM_SIZE)
+            continue;
+
+        const uint16_t read = c->mem[addr] << BYTE_SIZE | c->mem[addr + 1];
+        const uint16_t skip = c->mem[addr + 2] << BYTE_SIZE | c->mem[addr + 3];
+        const uint16_t jump = c->mem[addr + 4] << BYTE_SIZE | c->mem[addr + 5];
+        if ((read & 0xF0FF) != 0xF007 || skip != (0x3000 | (read & 0x0F00)) || jump != (0x1000 | addr))
+            continue;
+
+        // at the skip the register still holds the last value read
+        return back == 2 && !c->v[X(read)] ? 0 : addr;
+    }
+    return 0;
+}
+
+// Steps count instructions of the wait loop at addr without running them, the
+// delay timer has to stay above 0 meanwhile so the loop never leaves
+static inline
+void timer_wait_advance(Chip8 *c, uint16_t addr, uint32_t count) {
+    const uint16_t read = c->mem[addr] << BYTE_SIZE | c->mem[addr + 1];
+    const uint32_t phase = (c->pc - addr) / 2;
+    // the FX07 comes up after (3 - phase) % 3 instructions
+    if (count > (3 - phase) % 3)
+        c->v[X(read)] = c->delay_timer;
+    c->pc = addr + (phase + count) % 3 * 2;
+}
+
+// Brings the instance up to tick. A sleeping instance is still in its wait
+// loop, it ran the whole budget of every skipped frame there
+static inline
+void instance_catch_up(Instance *in, uint32_t tick, uint32_t instructions_per_frame) {
+    Chip8 *c = &in->chip8;
+    const uint32_t skipped = tick - in->frame;
+    in->frame = tick;
+    if (!skipped)
+        return;
+
+    if (in->parked) {
+        c->delay_timer = c->delay_timer > skipped ? c->delay_timer - skipped : 0;
+        c->sound_timer = c->sound_timer > skipped ? c->sound_timer - skipped : 0;
+        return;
+    }
+
+    const uint16_t loop = timer_wait_loop(c);
+    for (uint32_t frame = 0; frame < skipped; ++frame) {
+        if (loop)
+            timer_wait_advance(c, loop, instructions_per_frame);
+        chip8_update_timers(c);
+    }
+}
+
+// Catches up, then runs the rest of the frame in slices like the governor so a
+// ROM that blocks or waits gives up its budget. Every yield leaves the state a
+// whole frame of the plain interpreter would, batch input never changes:
+// a jump to itself and FX0A with no key change stay where they are, and a wait
+// loop is stepped through with timer_wait_advance
+static inline
+YieldReason instance_resume(Instance *in, uint32_t tick, uint32_t instructions_per_frame) {
+    Chip8 *c = &in->chip8;
+    instance_catch_up(in, tick, instructions_per_frame);
+
+    const uint32_t slice = (instructions_per_frame + GOVERNOR_SLICES - 1) / GOVERNOR_SLICES;
+    uint32_t retired = 0;
+    YieldReason reason = YIELD_FRAME_END;
+
+    while (retired < instructions_per_frame) {
+        const uint32_t count = instructions_per_frame - retired < slice ? instructions_per_frame - retired : slice;
+        const uint32_t ran = chip8_run(c, count);
+        retired += ran;
+
+        if (c->config.quirks & QUIRK_DISPLAY_WAIT && c->drawn) {
+            reason = YIELD_DISPLAY_WAIT;
+            break;
+        }
+
+        const uint16_t instruction = c->mem[c->pc] << BYTE_SIZE | c->mem[c->pc + 1];
+        if (instruction == (0x1000 | c->pc)) {
+            reason = YIELD_HALTED;
+            break;
+        }
+
+        if ((instruction & 0xF0FF) == 0xF00A && c->key_wait == c->keys) {
+            reason = YIELD_KEY_WAIT;
+            break;
+        }
+
+        const uint16_t loop = c->delay_timer ? timer_wait_loop(c) : 0;
+        if (loop) {
+            timer_wait_advance(c, loop, instructions_per_frame - retired);
+            reason = YIELD_IDLE;
+            break;
+        }
+    }
+
+    chip8_update_timers(c);
+    in->frame = tick + 1;
+    return reason;
+}
+
+// Runs every instance due at the current tick. Instances waiting for a key or
+// jumping to themselves are parked for good. One in a wait loop sleeps while
+// the delay timer stays above 0
+static inline
+void scheduler_tick(Scheduler *s) {
+    const uint32_t slot = s->tick & (SCHED_WHEEL_SIZE - 1);
+    for (uint32_t id = s->wheel[slot]; id != SCHED_NONE;) {
+        const uint32_t next = s->instances[id]->next;
+        scheduler_make_ready(s, id);
+        id = next;
+    }
+    s->wheel[slot] = SCHED_NONE;
+
+    while (s->ready_head != SCHED_NONE) {
+        const uint32_t id = s->ready_head;
+        Instance *in = s->instances[id];
+        s->ready_head = in->next;
+
+        const YieldReason reason = instance_resume(in, s->tick, s->instructions_per_frame);
+        s->resumes++;
+        s->yields[reason]++;
+
+        if (reason == YIELD_KEY_WAIT || reason == YIELD_HALTED) {
+            in->parked = 1;
+        } else if (reason == YIELD_IDLE) {
+            // wakes in the frame that starts with the timer at 0
+            const uint32_t ticks = in->chip8.delay_timer + 1;
+            scheduler_sleep(s, id, ticks < SCHED_WHEEL_SIZE ? ticks : SCHED_WHEEL_SIZE - 1);
+        } else {
+            scheduler_sleep(s, id, 1);
+        }
+    }
+    s->tick++;
+}
+
+// brings the instances still sleeping up to the last tick
+static inline
+void scheduler_settle(Scheduler *s) {
+    for (uint32_t id = 0; id < s->count; ++id)
+        instance_catch_up(s->instances[id], s->tick, s->instructions_per_frame);
+}
+
+// Header, then the states: one Chip8 for a headless run or instance_count
+// CheckpointInstance records for -instances. States are written as they are in
+// memory, so a checkpoint is only resumed by the same build
+typedef struct {
+    char       magic[4];
+    uint32_t   version;
+    uint32_t   chip8_size;
+    uint32_t   frame;                           // the next frame to run
+    uint64_t   rom_hash;
+    uint32_t   instance_count;                  // 0 for a single headless run
+    uint32_t   governor_ipf;
+    uint32_t   arg_count;
+    char       args[CHECKPOINT_ARGS_SIZE];      // the command line without the program name, NUL separated
+    Stats      stats;
+} CheckpointHeader;
+
+typedef struct {
+    uint32_t   frame;
+    uint32_t   parked;
+    Chip8      chip8;
+} CheckpointInstance;
+
+// Written every interval to a temporary file that replaces the checkpoint once
+// it is synced to disk, so the file on disk is always a whole checkpoint
+typedef struct {
+    const char        *path;
+    uint64_t           interval_ns;
+    uint64_t           next_ns;
+    CheckpointHeader   header;
+} Checkpointer;
+
+// A resumed run opens its outputs again, the ones that cover the whole run
+// would lose every frame before the checkpoint
+static inline
+void checkpoint_check_options(const Chip8 *c) {
+    const struct {
+        int         set;
+        const char *option;
+    } unsupported[] = {
+        { c->config.draw_path != NULL,          "-draw-stream" },
+        { c->config.archive_path != NULL,       "-archive" },
+        { c->config.coverage_path != NULL,      "-coverage" },
+        { c->config.trace_path != NULL,         "-trace-timeline" },
+        { c->config.log_path != NULL,           "-log" },
+    };
+
+    for (size_t k = 0; k < sizeof(unsupported) / sizeof(unsupported[0]); ++k) {
+        if (unsupported[k].set)
+            FATAL("%s can not be used with -checkpoint", unsupported[k].option);
+    }
+}
+
+static inline
+void checkpoint_start(Checkpointer *cp, const Chip8 *c, uint32_t rom_size, int argc, const char **argv) {
+    cp->path = c->config.checkpoint_path;
+    cp->interval_ns = (uint64_t)(c->config.checkpoint_seconds ?
+            c->config.checkpoint_seconds : CHECKPOINT_DEFAULT_SECONDS) * 1000000000ULL;
+    cp->next_ns = platform_time_ns() + cp->interval_ns;
+
+    CheckpointHeader *h = &cp->header;
+    memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic));
+    h->version = CHECKPOINT_VERSION;
+    h->chip8_size = sizeof(Chip8);
+    h->rom_hash = hash_bytes(&c->mem[PROGRAM_START_OFFSET], rom_size);
+
+    uint32_t len = 0;
+    for (int arg = 1; arg < argc; ++arg) {
+        const size_t arg_len = strlen(argv[arg]) + 1;
+        if (len + arg_len > CHECKPOINT_ARGS_SIZE || h->arg_count == CHECKPOINT_MAX_ARGS)
+            FATAL("Command line too long for -checkpoint");
+        memcpy(&h->args[len], argv[arg], arg_len);
+        len += arg_len;
+        h->arg_count++;
+    }
+}
+
+static inline
+int checkpoint_due(const Checkpointer *cp) {
+    return platform_time_ns() >= cp->next_ns;
+}
+
+static inline
+FILE *checkpoint_begin(Checkpointer *cp, char *tmp_path, uint32_t frame, uint32_t instance_count, uint32_t governor_ipf) {
+    snprintf(tmp_path, TCACHE_PATH_SIZE + 4, "%s.tmp", cp->path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "checkpoint: failed to open %s\n", tmp_path);
+        return NULL;
+    }
+
+    cp->header.frame = frame;
+    cp->header.instance_count = instance_count;
+    cp->header.governor_ipf = governor_ipf;
+    cp->header.stats = stats;
+    fwrite(&cp->header, sizeof(cp->header), 1, out);
+    return out;
+}
+
+static inline
+void checkpoint_commit(Checkpointer *cp, FILE *out, const char *tmp_path, uint64_t start) {
+    const int written = !ferror(out) && platform_sync_file(out);
+    fclose(out);
+    if (!written || !platform_replace_file(tmp_path, cp->path))
+        fprintf(stderr, "checkpoint: failed to write %s\n", cp->path);
+
+    const uint64_t now = platform_time_ns();
+    stats.checkpoints++;
+    stats.checkpoint_ns_total += now - start;
+    cp->next_ns = now + cp->interval_ns;
+}
+
+static inline
+void checkpoint_write(Checkpointer *cp, const Chip8 *c, uint32_t frame, uint32_t governor_ipf) {
+    const uint64_t start = platform_time_ns();
+    char tmp_path[TCACHE_PATH_SIZE + 4];
+    FILE *out = checkpoint_begin(cp, tmp_path, frame, 0, governor_ipf);
+    if (!out)
+        return;
+    fwrite(c, sizeof(*c), 1, out);
+    checkpoint_commit(cp, out, tmp_path, start);
+}
+
+static inline
+void checkpoint_write_instances(Checkpointer *cp, const Scheduler *s) {
+    const uint64_t start = platform_time_ns();
+    char tmp_path[TCACHE_PATH_SIZE + 4];
+    FILE *out = checkpoint_begin(cp, tmp_path, s->tick, s->count, 0);
+    if (!out)
+        return;
+
+    static CheckpointInstance record;
+    for (uint32_t id = 0; id < s->count; ++id) {
+        record.frame = s->instances[id]->frame;
+        record.parked = s->instances[id]->parked;
+        memcpy(&record.chip8, &s->instances[id]->chip8, sizeof(record.chip8));
+        fwrite(&record, sizeof(record), 1, out);
+    }
+    checkpoint_commit(cp, out, tmp_path, start);
+}
+
+// Maps a checkpoint for --resume and replaces the command line with the one it
+// was written by, followed by the options given after the file. The mapping
+// stays until the process exits
+static inline
+const CheckpointHeader *checkpoint_open(const char *path, int *argc, const char ***argv) {
+    static const char *args[CHECKPOINT_MAX_ARGS + 1];
+    size_t size = 0;
+    const CheckpointHeader *h = platform_map_file(path, &size);
+    if (!h)
+        FATAL("Failed to open checkpoint %s", path);
+
+    const size_t states = h->instance_count ? h->instance_count * sizeof(CheckpointInstance) : sizeof(Chip8);
+    if (size < sizeof(*h) ||
+        memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic)) ||
+        h->version != CHECKPOINT_VERSION ||
+        h->chip8_size != sizeof(Chip8) ||
+        h->arg_count > CHECKPOINT_MAX_ARGS ||
+        h->args[CHECKPOINT_ARGS_SIZE - 1] ||
+        size != sizeof(*h) + states)
+        FATAL("Not a checkpoint of this build: %s", path);
+
+    if (h->arg_count + *argc - 3 > CHECKPOINT_MAX_ARGS)
+        FATAL("Too many options after '--resume'");
+
+    int count = 0;
+    args[count++] = (*argv)[0];
+    const char *arg = h->args;
+    for (uint32_t k = 0; k < h->arg_count; ++k) {
+        args[count++] = arg;
+        arg += strlen(arg) + 1;
+    }
+    for (int extra = 3; extra < *argc; ++extra)
+        args[count++] = (*argv)[extra];
+    *argc = count;
+    *argv = args;
+
+    printf("checkpoint: resuming %s at frame %u\n", path, h->frame);
+    return h;
+}
+
+// counters carry on, timings are of this process
+static inline
+void checkpoint_restore_stats(const CheckpointHeader *h) {
+    const uint64_t main_start_ns = stats.main_start_ns;
+    stats = h->stats;
+    stats.main_start_ns = main_start_ns;
+    stats.startup_ns = 0;
+    stats.startup_cpu_ns = 0;
+    stats.checkpoints = 0;
+    stats.checkpoint_ns_total = 0;
+}
+
+static inline
+void checkpoint_check_rom(const CheckpointHeader *h, const Chip8 *c, uint32_t rom_size) {
+    if (h->rom_hash != hash_bytes(&c->mem[PROGRAM_START_OFFSET], rom_size))
+        FATAL("The rom changed since the checkpoint was written");
+}
+
+// keeps the configuration and engines of c, returns the next frame to run
+static inline
+uint32_t checkpoint_restore(const CheckpointHeader *h, Chip8 *c, Governor *g) {
+    if (h->instance_count)
+        FATAL("The checkpoint is of an -instances run");
+
+    Chip8 *loaded = &(Chip8){0};
+    memcpy(loaded, h + 1, sizeof(*loaded));
+    memcpy(&loaded->config, &c->config, sizeof(loaded->config));
+    loaded->profile = c->profile;
+    loaded->predecode = c->predecode;
+    loaded->tiered = c->tiered;
+    loaded->draws = c->draws;
+    chip8_restore(c, loaded);
+
+    if (g && h->governor_ipf)
+        g->ipf = h->governor_ipf;
+    checkpoint_restore_stats(h);
+    return h->frame;
+}
+
+// checked before anything is opened, batch runs only step the instances
+static inline
+void batch_check_options(const Chip8 *c) {
+    const struct {
+        int         set;
+        const char *option;
+    } unsupported[] = {
+        { c->config.engine_given && c->config.engine != ENGINE_INTERP, "-engine predecode or tiered" },
+        { c->config.heatmap,                    "-heatmap" },
+        { c->config.runahead != 0,              "-runahead" },
+        { c->config.governor_min_ips != 0,      "-governor" },
+        { c->config.netplay_port != 0,          "-netplay" },
+        { c->config.memsearch_path != NULL,     "-memsearch" },
+        { c->config.archive_path != NULL,       "-archive" },
+        { c->config.draw_path != NULL,          "-draw-stream" },
+        { c->config.coverage_path != NULL,      "-coverage" },
+        { c->config.trace_path != NULL,         "-trace-timeline" },
+        { c->config.tcache_dir != NULL,         "-tcache" },
+        { c->config.print_stats,                "-stats" },
+        { c->config.print_latency,              "-latency" },
+        { c->config.latency_dump_frames != 0,   "-latency-dump" },
+    };
+
+    for (size_t k = 0; k < sizeof(unsupported) / sizeof(unsupported[0]); ++k) {
+        if (unsupported[k].set)
+            FATAL("%s can not be used with -instances", unsupported[k].option);
+    }
+}
+
+// the state instance id starts from, a checkpoint record when resuming
+static inline
+void batch_instance_init(Instance *in, const Instance *template, const CheckpointInstance *records, uint32_t id) {
+    if (records) {
+        memcpy(&in->chip8, &records[id].chip8, sizeof(in->chip8));
+        memcpy(&in->chip8.config, &template->chip8.config, sizeof(in->chip8.config));
+        in->chip8.profile = NULL;
+        in->chip8.predecode = NULL;
+        in->chip8.tiered = NULL;
+        in->chip8.draws = NULL;
+        in->frame = records[id].frame;
+        in->parked = records[id].parked;
+    } else {
+        memcpy(in, template, sizeof(*in));
+        in->chip8.rng = template->chip8.rng + id * 0x9E3779B9u;
+        in->chip8.rng += !in->chip8.rng;
+    }
+}
+
+// Runs count copies of the loaded state on this thread with the interpreter,
+// each with its own random seed, and reports how often they had to be resumed.
+// -diffcheck then steps every copy again with the plain interpreter
+static inline
+int batch_run(const Chip8 *c, uint32_t count, uint32_t frames, uint32_t instructions_per_frame,
+        Checkpointer *cp, const CheckpointHeader *resume) {
+    static Instance template;
+    static InstancePool pool;
+    static Scheduler scheduler;
+    Scheduler *s = &scheduler;
+
+    if (!count || count > SCHED_MAX_INSTANCES)
+        FATAL("Instances must be between 1 and %u", SCHED_MAX_INSTANCES);
+
+    chip8_save(&template.chip8, c);
+    template.chip8.profile = NULL;
+    template.chip8.predecode = NULL;
+    template.chip8.tiered = NULL;
+    template.chip8.draws = NULL;
+    pool_init(&pool, &template, sizeof(template), count, c->config.huge_pages);
+    scheduler_init(s, instructions_per_frame);
+
+    if (resume) {
+        if (resume->instance_count != count)
+            FATAL("The checkpoint has %u instances", resume->instance_count);
+        s->tick = resume->frame;
+        checkpoint_restore_stats(resume);
+    }
+
+    const CheckpointInstance *records = resume ? (const CheckpointInstance *)(resume + 1) : NULL;
+    for (uint32_t id = 0; id < count; ++id) {
+        Instance *in = pool_acquire(&pool);
+        batch_instance_init(in, &template, records, id);
+        scheduler_add(s, in);
+    }
+
+    const uint32_t first_tick = s->tick;
+    const uint64_t start = platform_time_ns();
+    while (s->tick < frames) {
+        scheduler_tick(s);
+        if (cp && checkpoint_due(cp))
+            checkpoint_write_instances(cp, s);
+    }
+    scheduler_settle(s);
+    if (cp)
+        checkpoint_write_instances(cp, s);
+    const double seconds = (platform_time_ns() - start) / 1e9;
+
+    uint32_t parked = 0;
+    for (uint32_t id = 0; id < count; ++id)
+        parked += s->instances[id]->parked;
+
+    printf("batch: %u instances on %s, %u frames, %.2f s, %.0f instance frames/s\n",
+            count, ARENA_PAGES_NAMES[pool.pages], frames - first_tick, seconds,
+            (double)count * (frames - first_tick) / seconds);
+    printf("batch: %llu instructions, %.1f%% of the full budget, %u instances parked at the end\n",
+            (unsigned long long)stats.instructions,
+            100.0 * stats.instructions / ((double)count * frames * instructions_per_frame), parked);
+    printf("batch: %llu resumes, yields:", (unsigned long long)s->resumes);
+    for (uint32_t reason = 0; reason < YIELD_REASON_COUNT; ++reason)
+        printf("%s %s %llu", reason ? "," : "", YIELD_REASON_NAMES[reason], (unsigned long long)s->yields[reason]);
+    printf("\n");
+    if (stats.checkpoints) {
+        printf("batch: %llu checkpoints, avg %.2f ms, %.3f%% of the run time\n",
+                (unsigned long long)stats.checkpoints, stats.checkpoint_ns_total / 1e6 / stats.checkpoints,
+                100.0 * stats.checkpoint_ns_total / (seconds * 1e9));
+    }
+
+    if (c->config.diffcheck) {
+        static Instance reference;
+        for (uint32_t id = 0; id < count; ++id) {
+            batch_instance_init(&reference, &template, records, id);
+            instance_catch_up(&reference, first_tick, instructions_per_frame);
+            for (uint32_t frame = first_tick; frame < frames; ++frame) {
+                chip8_interpret(&reference.chip8, instructions_per_frame);
+                chip8_update_timers(&reference.chip8);
+            }
+
+            if (!chip8_state_equal(&s->instances[id]->chip8, &reference.chip8))
+                FATAL("diffcheck: instance %u diverged from the interpreter (pc: %u, interpreter pc: %u)",
+                        id, s->instances[id]->chip8.pc, reference.chip8.pc);
+        }
+        printf("diffcheck: %u instances match the interpreter after %u frames\n", count, frames);
+    }
+
+    pool_destroy(&pool);
+    return 0;
+}
+
+// the positional arguments are collected only under --launcher
+static int launcher_active = 0;
+static const char *launcher_roms[LAUNCHER_MAX_ROMS];
+static uint32_t launcher_rom_count = 0;
+
+// checked before anything is opened, these only take effect in the usual loop
+static inline
+void launcher_check_options(const Chip8 *c) {
+    const struct {
+        int         set;
+        const char *option;
+    } unsupported[] = {
+        { c->config.engine == ENGINE_TIERED,    "-engine tiered" },
+        { c->config.heatmap,                    "-heatmap" },
+        { c->config.headless_frames != 0,       "-headless" },
+        { c->config.runahead != 0,              "-runahead" },
+        { c->config.governor_min_ips != 0,      "-governor" },
+        { c->config.netplay_port != 0,          "-netplay" },
+        { c->config.memsearch_path != NULL,     "-memsearch" },
+        { c->config.archive_path != NULL,       "-archive" },
+        { c->config.draw_path != NULL,          "-draw-stream" },
+        { c->config.coverage_path != NULL,      "-coverage" },
+        { c->config.state_path != NULL,         "-state" },
+        { c->config.trace_path != NULL,         "-trace-timeline" },
+        { c->config.tcache_dir != NULL,         "-tcache" },
+        { c->config.diffcheck,                  "-diffcheck" },
+        { c->config.instances != 0,             "-instances" },
+    };
+
+    for (size_t k = 0; k < sizeof(unsupported) / sizeof(unsupported[0]); ++k) {
+        if (unsupported[k].set)
+            FATAL("%s can not be used with --launcher", unsupported[k].option);
+    }
+}
+
+// below the display, the shown rom in reverse video
+static inline
+void launcher_print_menu(uint32_t active) {
+    printf(ESC"[%dB\r", DISPLAY_HEIGHT);
+    for (uint32_t k = 0; k < launcher_rom_count; ++k)
+        printf("%s %s "RESET_ATTRIBUTES" ", k == active ? REVERSE_VIDEO : "", launcher_roms[k]);
+    printf(ESC"[K");
+    platform_cursor_up(DISPLAY_HEIGHT);
+    fflush(stdout);
+}
+
+// Every rom gets a resident instance from the pool, but only the one on screen
+// runs; the others stay paused and cost nothing but their memory. TAB shows
+// the next rom right away, the platform and terminal are set up only once
+static inline
+int launcher_run(const Chip8 *c, uint32_t instructions_per_frame, uint32_t frames_per_sec) {
+    static Chip8 template;
+    static InstancePool pool;
+    static Chip8 *instances[LAUNCHER_MAX_ROMS];
+    static Predecode predecode[LAUNCHER_MAX_ROMS];
+
+    chip8_save(&template, c);
+    template.profile = NULL;
+    template.predecode = NULL;
+    template.tiered = NULL;
+    template.draws = NULL;
+    pool_init(&pool, &template, sizeof(template), launcher_rom_count, c->config.huge_pages);
+
+    for (uint32_t k = 0; k < launcher_rom_count; ++k) {
+        instances[k] = pool_acquire(&pool);
+        chip8_load_rom(instances[k], launcher_roms[k]);
+        if (c->config.engine == ENGINE_PREDECODE)
+            instances[k]->predecode = &predecode[k];
+    }
+
+    platform_launcher_keys = 1;
+    if (!platform_setup())
+        FATAL("Failed to setup platform");
+
+    uint32_t active = 0;
+    KeyStates held = 0;
+    launcher_print_menu(active);
+
+    for (uint64_t frame = 1;; ++frame) {
+        latency_frame_start();
+        Chip8 *in = instances[active];
+
+        in->keys = held & LAUNCHER_KEYPAD_MASK;
+        chip8_run(in, instructions_per_frame);
+        in->delay_timer -= in->delay_timer != 0;
+        in->sound_timer -= in->sound_timer != 0 ? platform_beep() : 0;
+        chip8_display(in);
+
+        const int tab_was_down = KEY_DOWN(held, CKEY_TAB);
+        platform_set_keystates(&held);
+        if (platform_is_paused())
+            platform_wait_while_paused(&held);
+
+        if (KEY_DOWN(held, CKEY_ESC))
+            break;
+
+        if (!tab_was_down && KEY_DOWN(held, CKEY_TAB)) {
+            const uint64_t switch_start = platform_time_ns();
+            active = (active + 1) % launcher_rom_count;
+            chip8_display(instances[active]);
+            launcher_print_menu(active);
+
+            const uint64_t elapsed = platform_time_ns() - switch_start;
+            stats.switches++;
+            stats.switch_ns_max = elapsed > stats.switch_ns_max ? elapsed : stats.switch_ns_max;
+        }
+
+        platform_sleep(1000/frames_per_sec);
+        stats_note_first_frame();
+
+        if (c->config.latency_dump_frames && frame % c->config.latency_dump_frames == 0)
+            latency_dump();
+    }
+
+    platform_revert();
+
+    if (c->config.print_stats)
+        print_stats(instances[active]);
+
+    if (c->config.print_latency)
+        latency_print(stdout, NULL);
+
+    pool_destroy(&pool);
+    return 0;
+}
+
+// Rollout pattern: a random live instance is destroyed and a fresh one
+// created from the template and touched, with the pool on small then huge pages
+static inline
+int pool_bench(void) {
+    static Chip8 template = { .rng = DEFAULT_RNG_SEED };
+    static Chip8 *live[POOL_BENCH_INSTANCES];
+    chip8_load_to_mem(&template, FONT_DATA_OFFSET, FONT_DATA, sizeof(FONT_DATA));
+
+    for (int huge = 0; huge <= 1; ++huge) {
+        InstancePool pool;
+        pool_init(&pool, &template, sizeof(template), POOL_BENCH_INSTANCES, huge);
+        for (uint32_t k = 0; k < POOL_BENCH_INSTANCES; ++k)
+            live[k] = pool_acquire(&pool);
+
+        uint32_t rng = DEFAULT_RNG_SEED;
+        const int counter = platform_tlb_counter_open();
+        const uint64_t start = platform_time_ns();
+        for (uint32_t cycle = 0; cycle < POOL_BENCH_CYCLES; ++cycle) {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            const uint32_t k = rng % POOL_BENCH_INSTANCES;
+
+            pool_release(&pool, live[k]);
+            live[k] = pool_acquire(&pool);
+            live[k]->mem[rng % MEM_SIZE] = (uint8_t)cycle;
+            live[k]->pc = PROGRAM_START_OFFSET;
+        }
+        const double seconds = (platform_time_ns() - start) / 1e9;
+        const uint64_t misses = counter >= 0 ? platform_tlb_counter_close(counter) : 0;
+
+        printf("pool: %u x %u byte instances on %s, %zu MiB arena\n",
+                POOL_BENCH_INSTANCES, pool.stride, ARENA_PAGES_NAMES[pool.pages], pool.arena_size >> 20);
+        printf("pool: %.0f create/reset/destroy cycles/s", POOL_BENCH_CYCLES / seconds);
+        if (counter >= 0)
+            printf(", %.2f dTLB misses per cycle\n", (double)misses / POOL_BENCH_CYCLES);
+        else
+            printf(", dTLB misses not available\n");
+
+        pool_destroy(&pool);
+    }
+    return 0;
+}
+
+// Writes the events of all threads in the Chrome trace event format, timestamps
+// in microseconds from the first event
+static inline
+void trace_export(TraceBuffer *const *buffers, uint32_t buffer_count, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "trace: failed to open %s\n", path);
+        return;
+    }
+
+    uint64_t origin = UINT64_MAX;
+    for (uint32_t b = 0; b < buffer_count; ++b) {
+        if (buffers[b]->count && buffers[b]->events[0].start_ns < origin)
+            origin = buffers[b]->events[0].start_ns;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    uint32_t written = 0;
+    for (uint32_t b = 0; b < buffer_count; ++b) {
+        const TraceBuffer *t = buffers[b];
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                b ? ",\n" : "", b + 1, t->name);
+
+        for (uint32_t k = 0; k < t->count; ++k) {
+            const TraceEvent *e = &t->events[k];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    TRACE_PHASE_NAMES[e->phase], b + 1,
+                    (e->start_ns - origin) / 1000.0,
+                    (e->end_ns - e->start_ns) / 1000.0);
+        }
+        written += t->count;
+
+        if (t->dropped)
+            fprintf(stderr, "trace: %s dropped %u events after the first %u\n", t->name, t->dropped, TRACE_MAX_EVENTS);
+    }
+    fprintf(out, "\n]}\n");
+
+    const int failed = ferror(out);
+    fclose(out);
+    if (failed)
+        fprintf(stderr, "trace: failed to write %s\n", path);
+    else
+        printf("trace: %u events written to %s\n", written, path);
+}
+
+// Two instances exchange their key states every frame. The remote input of a
+// frame that has not arrived yet is predicted to be the last confirmed one; a
+// misprediction rewinds to that frame's savestate and simulates forward again
+typedef struct {
+    PlatformSocket   socket;
+    PlatformAddress  peer;
+    uint32_t         frame;                             // next frame to emulate
+    uint32_t         remote_confirmed;                  // remote input is known for frames below this
+    uint32_t         remote_ack;                        // peer has our input for frames below this
+    uint32_t         rollback_from;                     // earliest mispredicted frame, UINT32_MAX if none
+    KeyStates        local_keys;
+    KeyStates        local[NETPLAY_HISTORY];            // all indexed by frame % NETPLAY_HISTORY
+    KeyStates        remote[NETPLAY_HISTORY];
+    KeyStates        used_remote[NETPLAY_HISTORY];
+    Chip8            states[NETPLAY_HISTORY];           // instance at the start of the frame
+} Netplay;
+
+static inline
+void netplay_start(Netplay *np, uint16_t port, const char *peer) {
+    // opening the socket starts winsock, which resolving needs
+    if ((np->socket = platform_udp_open(port)) == INVALID_PLATFORM_SOCKET)
+        FATAL("Failed to open UDP port %u", port);
+
+    if (!platform_udp_resolve(peer, &np->peer))
+        FATAL("Failed to resolve netplay peer: %s", peer);
+
+    np->rollback_from = UINT32_MAX;
+    printf("netplay: port %u, peer %s\n", port, peer);
+}
+
+static inline
+void netplay_send(Netplay *np) {
+    NetplayPacket packet = {
+        .magic = NETPLAY_MAGIC,
+        .frame_count = np->frame,
+        .ack = np->remote_confirmed,
+        .base_frame = np->remote_ack,
+        .base_keys = np->local[np->remote_ack % NETPLAY_HISTORY],
+    };
+
+    for (uint32_t f = np->remote_ack + 1; f < np->frame; ++f) {
+        if (np->local[f % NETPLAY_HISTORY] == np->local[(f - 1) % NETPLAY_HISTORY])
+            continue;
+
+        // the rest goes out once the peer acknowledged this much
+        if (packet.change_count == NETPLAY_MAX_CHANGES) {
+            packet.frame_count = f;
+            break;
+        }
+        packet.changes[packet.change_count++] = (KeyChange) { .frame = f, .keys = np->local[f % NETPLAY_HISTORY] };
+    }
+
+    uint32_t *words = (uint32_t *)&packet;
+    for (uint32_t i = 0; i < sizeof(packet) / sizeof(uint32_t); ++i)
+        words[i] = htonl(words[i]);
+
+    platform_udp_send(np->socket, &np->peer, &packet, sizeof(packet));
+}
+
+static inline
+void netplay_receive(Netplay *np) {
+    NetplayPacket packet;
+
+    while (platform_udp_recv(np->socket, &packet, sizeof(packet)) == sizeof(packet)) {
+        uint32_t *words = (uint32_t *)&packet;
+        for (uint32_t i = 0; i < sizeof(packet) / sizeof(uint32_t); ++i)
+            words[i] = ntohl(words[i]);
+
+        if (packet.magic != NETPLAY_MAGIC || packet.change_count > NETPLAY_MAX_CHANGES)
+            continue;
+
+        np->remote_ack = packet.ack > np->remote_ack && packet.ack <= np->frame ? packet.ack : np->remote_ack;
+
+        // stale or starts after a frame we have not received yet
+        if (packet.frame_count <= np->remote_confirmed || packet.base_frame > np->remote_confirmed)
+            continue;
+
+        // frames further ahead would overwrite history that is still needed
+        const uint32_t end = packet.frame_count < np->remote_confirmed + NETPLAY_HISTORY ?
+            packet.frame_count : np->remote_confirmed + NETPLAY_HISTORY;
+
+        KeyStates remote_keys = packet.base_keys;
+        uint32_t change = 0;
+        for (uint32_t f = packet.base_frame; f < end; ++f) {
+            while (change < packet.change_count && packet.changes[change].frame <= f)
+                remote_keys = packet.changes[change++].keys;
+
+            if (f < np->remote_confirmed)
+                continue;
+
+            np->remote[f % NETPLAY_HISTORY] = remote_keys;
+            if (f < np->frame && remote_keys != np->used_remote[f % NETPLAY_HISTORY] && f < np->rollback_from)
+                np->rollback_from = f;
+        }
+        np->remote_confirmed = end;
+    }
+}
+
+static inline
+void netplay_simulate(Netplay *np, Chip8 *c, uint32_t frame, uint32_t instructions_per_frame) {
+    const uint32_t slot = frame % NETPLAY_HISTORY;
+    chip8_save(&np->states[slot], c);
+    np->used_remote[slot] = np->remote[slot];
+    c->keys = np->local[slot] | np->remote[slot];
+    chip8_run(c, instructions_per_frame);
+    chip8_update_timers(c);
+}
+
+// Advances one frame with local_keys, returns 0 when stalled waiting for the peer
+static inline
+int netplay_advance(Netplay *np, Chip8 *c, uint32_t instructions_per_frame) {
+    netplay_receive(np);
+
+    if (np->rollback_from < np->frame) {
+        const uint64_t start = platform_time_ns();
+
+        chip8_restore(c, &np->states[np->rollback_from % NETPLAY_HISTORY]);
+        for (uint32_t f = np->rollback_from; f < np->frame; ++f)
+            netplay_simulate(np, c, f, instructions_per_frame);
+
+        const uint64_t elapsed = platform_time_ns() - start;
+        INFO("netplay: rolled back %u frames from frame %u in %llu us",
+                np->frame - np->rollback_from, np->rollback_from, (unsigned long long)(elapsed / 1000));
+        stats.rollbacks++;
+        stats.rollback_frames += np->frame - np->rollback_from;
+        stats.rollback_ns_max = elapsed > stats.rollback_ns_max ? elapsed : stats.rollback_ns_max;
+    }
+    np->rollback_from = UINT32_MAX;
+
+    // can not predict further than the history we can roll back
+    if (np->frame >= np->remote_confirmed + NETPLAY_HISTORY - 1 ||
+        np->frame >= np->remote_ack + NETPLAY_HISTORY - 1) {
+        netplay_send(np);
+        platform_udp_wait(np->socket, NETPLAY_WAIT_MS);
+        stats.netplay_stalls++;
+        return 0;
+    }
+
+    const uint32_t slot = np->frame % NETPLAY_HISTORY;
+    np->local[slot] = np->local_keys;
+    if (np->frame >= np->remote_confirmed)
+        np->remote[slot] = np->remote_confirmed ? np->remote[(np->remote_confirmed - 1) % NETPLAY_HISTORY] : 0;
+
+    netplay_simulate(np, c, np->frame, instructions_per_frame);
+    stats.frames++;
+    np->frame++;
+
+    netplay_send(np);
+    return 1;
+}
+
+static inline
+void coverage_write_hex(FILE *file, const uint8_t *bitmap) {
+    for (uint32_t i = 0; i < COVERAGE_BITMAP_SIZE; ++i)
+        fprintf(file, "%02x", bitmap[i]);
+}
+
+static inline
+int coverage_read_hex(const char *text, const char *key, uint8_t *bitmap) {
+    const char *start = strstr(text, key);
+    if (!start || !(start = strchr(start + strlen(key), '"')))
+        return 0;
+
+    start++;
+    for (uint32_t i = 0; i < COVERAGE_BITMAP_SIZE; ++i) {
+        unsigned int byte;
+        if (sscanf(&start[i * 2], "%2x", &byte) != 1)
+            return 0;
+        bitmap[i] = byte;
+    }
+    return 1;
+}
+
+static inline
+uint32_t coverage_count(const uint8_t *bitmap) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < MEM_SIZE; ++i)
+        count += (bitmap[i / BYTE_SIZE] >> (i % BYTE_SIZE)) & 1;
+    return count;
+}
+
+// Executed addresses are green, addresses read as data are red, both are yellow.
+// Every memory address is one COVERAGE_IMAGE_SCALE sized square in a 64x64 grid
+static inline
+void coverage_write_ppm(FILE *file, const Profile *p) {
+    const uint32_t side = COVERAGE_IMAGE_WIDTH * COVERAGE_IMAGE_SCALE;
+    fprintf(file, "P6\n%u %u\n255\n", side, side);
+
+    for (uint32_t py = 0; py < side; ++py) {
+        for (uint32_t px = 0; px < side; ++px) {
+            const uint32_t addr = (py / COVERAGE_IMAGE_SCALE) * COVERAGE_IMAGE_WIDTH + px / COVERAGE_IMAGE_SCALE;
+            const uint8_t bit = 1 << (addr % BYTE_SIZE);
+            const uint8_t pixel[3] = {
+                p->read[addr / BYTE_SIZE] & bit ? 0xFF : 0,
+                p->executed[addr / BYTE_SIZE] & bit ? 0xFF : 0,
+                0,
+            };
+            fwrite(pixel, 1, sizeof(pixel), file);
+        }
+    }
+}
+
+// writes s as a quoted JSON string
+static inline
+void json_write_string(FILE *file, const char *s) {
+    fputc('"', file);
+    for (; *s; ++s) {
+        const unsigned char ch = *s;
+        if (ch == '"' || ch == '\\')
+            fprintf(file, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(file, "\\u%04x", ch);
+        else
+            fputc(ch, file);
+    }
+    fputc('"', file);
+}
+
+// Output format is picked from the file extension: .ppm writes an image heatmap, anything else JSON
+static inline
+void coverage_export(const Profile *p, const char *rom, const char *file_path) {
+    FILE *file = fopen(file_path, "wb");
+    if (!file)
+        FATAL("Failed to open coverage file: %s", file_path);
+
+    const char *ext = strrchr(file_path, '.');
+    if (ext && !strcmp(ext, ".ppm")) {
+        coverage_write_ppm(file, p);
+    } else {
+        fprintf(file, "{\n  \"rom\": ");
+        json_write_string(file, rom);
+        fprintf(file, ",\n");
+        fprintf(file, "  \"executed_count\": %u,\n", coverage_count(p->executed));
+        fprintf(file, "  \"read_count\": %u,\n", coverage_count(p->read));
+        fprintf(file, "  \"executed\": \"");
+        coverage_write_hex(file, p->executed);
+        fprintf(file, "\",\n  \"read\": \"");
+        coverage_write_hex(file, p->read);
+        fprintf(file, "\"\n}\n");
+    }
+
+    fclose(file);
+}
+
+// ORs the bitmaps of every JSON coverage file in paths into out_path
+static inline
+int coverage_merge(const char *out_path, int count, const char **paths) {
+    if (count < 1)
+        FATAL("No coverage files to merge");
+
+    Profile merged = {0};
+    static char text[COVERAGE_BITMAP_SIZE * 8];
+
+    for (int i = 0; i < count; ++i) {
+        FILE *file = fopen(paths[i], "rb");
+        if (!file)
+            FATAL("Failed to open coverage file: %s", paths[i]);
+
+        const size_t len = fread(text, 1, sizeof(text) - 1, file);
+        text[len] = '\0';
+        fclose(file);
+
+        Profile p;
+        if (!coverage_read_hex(text, "\"executed\":", p.executed) ||
+            !coverage_read_hex(text, "\"read\":", p.read))
+            FATAL("Malformed coverage file: %s", paths[i]);
+
+        for (uint32_t b = 0; b < COVERAGE_BITMAP_SIZE; ++b) {
+            merged.executed[b] |= p.executed[b];
+            merged.read[b] |= p.read[b];
+        }
+    }
+
+    coverage_export(&merged, "merged", out_path);
+    printf("Merged %d coverage files: %u executed, %u read\n",
+            count,
+            coverage_count(merged.executed),
+            coverage_count(merged.read));
+    return 0;
+}
+
+static inline
+const char *usage(void) {
+    return
+        "Usage: chip8 <rom> [options]\n"
+        "Options:\n"
+        "    --help, -h             Display this information.\n"
+        "    -ips <arg>             Instructions per second to use, must be greater or equal to FPS (Default: " STRINGIFY(DEFAULT_IPS) ").\n"
+        "    -fps <arg>             Frames per second to use (Default: " STRINGIFY(DEFAULT_FPS) ").\n"
+        "    -qshift-use-vy         Quirk: set VY to VX before bit shifting operations.\n"
+        "    -qbxnn                 Quirk: use BXNN version of BNNN (Jump with offset) operation.\n"
+        "    -qinc-index            Quirk: increment index register on memory load/store operations.\n"
+        "    -qdisplay-wait         Quirk: wait for the vertical blank after each sprite draw.\n"
+        "    -fg <hexcode>          Set pixel 'on' color (foreground). Eg: FF0000 for red\n"
+        "    -bg <hexcode>          Set pixel 'off' color (background). Eg: 00FF00 for green\n"
+        "    -governor <min_ips>    Lower the instruction rate down to <min_ips> while the ROM is idle, -ips is the ceiling.\n"
+        "    -memsearch <file>      Run memory search and freeze commands appended to <file>, one per line.\n"
+        "    -headless <frames>     Run the given number of frames without display, input or frame pacing.\n"
+        "    -instances <n>         With -headless, run <n> differently seeded copies of the rom on one thread.\n"
+        "                           Takes the speed, quirk, state, checkpoint and diffcheck options.\n"
+        "    -hugepages             Back the -instances pool with huge pages.\n"
+        "    -checkpoint <file>     With -headless, keep <file> up to date with a checkpoint to --resume from.\n"
+        "                           Not with -draw-stream, -archive, -coverage, -trace-timeline or -log.\n"
+        "    -checkpoint-every <s>  Seconds between checkpoints (Default: " STRINGIFY(CHECKPOINT_DEFAULT_SECONDS) ").\n"
+        "    -engine <name>         Execution engine: interp, predecode or tiered (Default: interp).\n"
+        "    -tcache <dir>          Keep the predecode engine's translations in <dir>, keyed by rom hash and quirks.\n"
+        "    -runahead <frames>     Show the frame this many frames ahead to hide input lag (Default: 0).\n"
+        "    -netplay <port>        Play over UDP from this local port, the peer's keys are merged with the local ones.\n"
+        "    -peer <host:port>      Address of the other netplay instance.\n"
+        "    -log-level <level>     Log level: off, info or debug, debug logs every instruction (Default: off).\n"
+        "    -log <file>            Write the log to <file> instead of stderr.\n"
+        "    -trace-timeline <file> Record the phases of every frame and export them as Chrome trace events on exit.\n"
+        "    -stats                 Print execution statistics on exit.\n"
+        "    -latency               Print p50/p90/p99/p99.9/max of frame period, batch, display and sleep times on exit.\n"
+        "    -latency-dump <frames> Print the latency percentiles of the last <frames> frames to stderr as they pass.\n"
+        "    -diffcheck             With -headless, run the interpreter in lockstep and stop at the first diverging frame.\n"
+        "                           With -instances, compare every instance with the interpreter at the end.\n"
+        "    -heatmap               Show a live read/write/execute heatmap of memory next to the display.\n"
+        "    -coverage <file>       Record executed/read addresses and export them on exit (.json or .ppm).\n"
+        "    --search <expr> <rom> [options]\n"
+        "                           Best-first search for the key inputs that maximize <expr>, eg. 'mem[0x3F0] * 10 - v[2]'.\n"
+        "    -search-nodes <n>      States expanded by --search (Default: " STRINGIFY(SEARCH_DEFAULT_NODES) ").\n"
+        "    -search-depth <frames> Frames --search looks ahead (Default: " STRINGIFY(SEARCH_DEFAULT_DEPTH) ").\n"
+        "    -search-hold <frames>  Frames each --search input is held (Default: " STRINGIFY(SEARCH_DEFAULT_HOLD) ").\n"
+        "    -search-keys <hex>     Mask of the keys --search may press (Default: FFFF).\n"
+        "    -archive <file>        Store every frame or --search state in a deduplicated savestate archive.\n"
+        "    -state <file>:<n>      Start from state <n> of a savestate archive.\n"
+        "    -draw-stream <file>    Write the display as clears and sprite draws per frame, <file> may be a FIFO.\n"
+        "    -draw-keyframes <n>    Frames between whole frames in the draw stream for late joiners (Default: " STRINGIFY(DRAW_DEFAULT_KEYFRAMES) ").\n"
+        "    --launcher <rom>...    Preload the roms, each paused while another is shown. TAB switches, ESC quits.\n"
+        "                           Takes the display, speed, quirk, stats and predecode options.\n"
+        "    --resume <file> ...    Continue the run that wrote the checkpoint <file>, with its options and any given after it.\n"
+        "    --embed <rom> <header> Write a header that compiles <rom> into the binary, see EMBED_ROM in main.c.\n"
+        "    --pool-bench           Measure instance create/reset/destroy cycles and dTLB misses on small and huge pages.\n"
+        "    --draw-info <file> [frame]\n"
+        "                           Join a draw stream at the first keyframe from [frame] on and check it rebuilds the display.\n"
+        "    --archive-info <file>  Print the number of states and the deduplication ratio of an archive.\n"
+        "    --merge-coverage <out> <in>...\n"
+        "                           Merge coverage files of several runs into <out> (.json or .ppm).\n"
+    ;
+}
+
+static inline
+void generate_ansi_coded_text(int32_t color, const char *out_text, const char *default_text) {
+    char color_format_buffer[ANSI_COLOR_FORMAT_LEN];
+    size_t str_len = 0;
+
+    if (color != -1)
+        str_len = snprintf(color_format_buffer,
+                ANSI_COLOR_FORMAT_LEN,
+                ANSI_COLOR_FORMAT PIXEL_TEXT,
+                color >> 16 & 0xFF,
+                color >>  8 & 0xFF,
+                color >>  0 & 0xFF);
+    else
+        str_len = snprintf(color_format_buffer,
+                ANSI_COLOR_FORMAT_LEN,
+                default_text);
+    memcpy((char*)out_text, color_format_buffer, str_len);
 }
 
 static inline
@@ -527,7 +4929,8 @@ void parse_cmdline_args(Chip8 *c, CmdLineArgs *args, const char **rom) {
     uint32_t
         ips = 0,
         fps = 0,
-        quirks = 0;
+        quirks = 0,
+        headless_frames = 0;
     int32_t
         fgc = -1,
         bgc = -1;
@@ -537,8 +4940,38 @@ void parse_cmdline_args(Chip8 *c, CmdLineArgs *args, const char **rom) {
     const char quirk_shift_use_vy[]     = "-qshift-use-vy";
     const char quirk_bxnn[]             = "-qbxnn";
     const char quirk_inc_index[]        = "-qinc-index";
+    const char quirk_display_wait[]     = "-qdisplay-wait";
     const char fgcolor[]                = "-fg";
     const char bgcolor[]                = "-bg";
+    const char headless[]               = "-headless";
+    const char coverage[]               = "-coverage";
+    const char heatmap[]                = "-heatmap";
+    const char engine[]                 = "-engine";
+    const char stats_flag[]             = "-stats";
+    const char instances[]              = "-instances";
+    const char huge_pages[]             = "-hugepages";
+    const char checkpoint[]             = "-checkpoint";
+    const char checkpoint_every[]       = "-checkpoint-every";
+    const char draw_stream[]            = "-draw-stream";
+    const char draw_keyframes[]         = "-draw-keyframes";
+    const char latency_flag[]           = "-latency";
+    const char latency_dump_frames[]    = "-latency-dump";
+    const char tcache[]                 = "-tcache";
+    const char runahead[]               = "-runahead";
+    const char netplay[]                = "-netplay";
+    const char governor[]               = "-governor";
+    const char memsearch[]              = "-memsearch";
+    const char search_nodes[]           = "-search-nodes";
+    const char archive[]                = "-archive";
+    const char trace_timeline[]         = "-trace-timeline";
+    const char log_file[]               = "-log";
+    const char log_level_opt[]          = "-log-level";
+    const char state[]                  = "-state";
+    const char search_depth[]           = "-search-depth";
+    const char search_hold[]            = "-search-hold";
+    const char search_keys[]            = "-search-keys";
+    const char peer[]                   = "-peer";
+    const char diffcheck[]              = "-diffcheck";
     const char help1[]                  = "--help";
     const char help2[]                  = "-h";
 
@@ -566,6 +4999,115 @@ void parse_cmdline_args(Chip8 *c, CmdLineArgs *args, const char **rom) {
         else if (STRMATCH(quirk_bxnn))
             quirks |= QUIRK_BXNN;
 
+        else if (STRMATCH(quirk_display_wait))
+            quirks |= QUIRK_DISPLAY_WAIT;
+
+        else if (STRMATCH(headless))
+            headless_frames = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(heatmap))
+            c->config.heatmap = 1;
+
+        else if (STRMATCH(engine)) {
+            const char *name = parse_option_value_to_str(args);
+            if (!strcmp(name, "interp"))
+                c->config.engine = ENGINE_INTERP;
+            else if (!strcmp(name, "predecode"))
+                c->config.engine = ENGINE_PREDECODE;
+            else if (!strcmp(name, "tiered"))
+                c->config.engine = ENGINE_TIERED;
+            else
+                FATAL("Unknown engine: %s", name);
+            c->config.engine_given = 1;
+        }
+
+        else if (STRMATCH(trace_timeline))
+            c->config.trace_path = parse_option_value_to_str(args);
+
+        else if (STRMATCH(log_file))
+            c->config.log_path = parse_option_value_to_str(args);
+
+        else if (STRMATCH(log_level_opt)) {
+            const char *name = parse_option_value_to_str(args);
+            if (!strcmp(name, "off"))
+                log_level = LOG_OFF;
+            else if (!strcmp(name, "info"))
+                log_level = LOG_INFO;
+            else if (!strcmp(name, "debug"))
+                log_level = LOG_DEBUG;
+            else
+                FATAL("Unknown log level: %s", name);
+        }
+
+        else if (STRMATCH(archive))
+            c->config.archive_path = parse_option_value_to_str(args);
+
+        else if (STRMATCH(state))
+            c->config.state_path = parse_option_value_to_str(args);
+
+        else if (STRMATCH(search_nodes))
+            c->config.search_nodes = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(search_depth))
+            c->config.search_depth = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(search_hold))
+            c->config.search_hold = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(search_keys))
+            c->config.search_keys = parse_option_value_to_uint(args, 16);
+
+        else if (STRMATCH(memsearch))
+            c->config.memsearch_path = parse_option_value_to_str(args);
+
+        else if (STRMATCH(governor))
+            c->config.governor_min_ips = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(netplay))
+            c->config.netplay_port = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(peer))
+            c->config.netplay_peer = parse_option_value_to_str(args);
+
+        else if (STRMATCH(runahead))
+            c->config.runahead = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(tcache))
+            c->config.tcache_dir = parse_option_value_to_str(args);
+
+        else if (STRMATCH(stats_flag))
+            c->config.print_stats = 1;
+
+        else if (STRMATCH(instances))
+            c->config.instances = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(huge_pages))
+            c->config.huge_pages = 1;
+
+        else if (STRMATCH(checkpoint))
+            c->config.checkpoint_path = parse_option_value_to_str(args);
+
+        else if (STRMATCH(checkpoint_every))
+            c->config.checkpoint_seconds = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(draw_stream))
+            c->config.draw_path = parse_option_value_to_str(args);
+
+        else if (STRMATCH(draw_keyframes))
+            c->config.draw_keyframes = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(latency_flag))
+            c->config.print_latency = 1;
+
+        else if (STRMATCH(latency_dump_frames))
+            c->config.latency_dump_frames = parse_option_value_to_uint(args, 10);
+
+        else if (STRMATCH(diffcheck))
+            c->config.diffcheck = 1;
+
+        else if (STRMATCH(coverage))
+            c->config.coverage_path = parse_option_value_to_str(args);
+
         else if (STRMATCH(help1) || STRMATCH(help2)) {
             printf("%s", usage());
             exit(0);
@@ -574,8 +5116,14 @@ void parse_cmdline_args(Chip8 *c, CmdLineArgs *args, const char **rom) {
         else if (!strncmp("-", arg, 1))
             FATAL("Unrecognized command-line option: %s", arg);
 
-        else
+        else {
             *rom = arg;
+            if (launcher_active) {
+                if (launcher_rom_count == LAUNCHER_MAX_ROMS)
+                    FATAL("More than %u roms for '--launcher'", LAUNCHER_MAX_ROMS);
+                launcher_roms[launcher_rom_count++] = arg;
+            }
+        }
 
     }
 
@@ -585,24 +5133,223 @@ void parse_cmdline_args(Chip8 *c, CmdLineArgs *args, const char **rom) {
     c->config.instructions_per_frame = ips;
     c->config.frames_per_sec = fps;
     c->config.quirks = quirks;
+    c->config.headless_frames = headless_frames;
 
+#ifndef EMBED_ROM
     if (!*rom)
         FATAL("No rom specified");
+#endif
 }
 
 int main(int argc, const char **argv) {
+    stats.main_start_ns = platform_time_ns();
 
+#ifndef EMBED_ROM
     if (argc < 2)
         FATAL("No rom specified");
+#endif
+    // the embedded rom runs when none is given
+    const char *command = argc > 1 ? argv[1] : "";
+
+    if (!strcmp(command, "--merge-coverage")) {
+        if (argc < 3)
+            FATAL("Missing output file for '--merge-coverage'");
+        return coverage_merge(argv[2], argc - 3, &argv[3]);
+    }
+
+    if (!strcmp(command, "--pool-bench"))
+        return pool_bench();
+
+    if (!strcmp(command, "--embed")) {
+        if (argc < 4)
+            FATAL("Missing rom or header for '--embed'");
+        return embed_write(argv[2], argv[3]);
+    }
+
+    if (!strcmp(command, "--draw-info")) {
+        if (argc < 3)
+            FATAL("Missing draw stream for '--draw-info'");
+        return draw_info(argv[2], argc > 3 ? strtoull(argv[3], NULL, 10) : 0);
+    }
+
+    if (!strcmp(command, "--archive-info")) {
+        if (argc < 3)
+            FATAL("Missing archive for '--archive-info'");
+        return archive_info(argv[2]);
+    }
+
+    // the run goes on with the command line stored in the checkpoint
+    const CheckpointHeader *resume = NULL;
+    if (!strcmp(command, "--resume")) {
+        if (argc < 3)
+            FATAL("Missing checkpoint for '--resume'");
+        resume = checkpoint_open(argv[2], &argc, &argv);
+    }
+
+    // the rest of the command line is the usual rom and options
+    const char *search_expr = NULL;
+    int launcher = 0;
+    if (!strcmp(command, "--launcher")) {
+        if (argc < 3)
+            FATAL("Missing roms for '--launcher'");
+        launcher = 1;
+        launcher_active = 1;
+        argc -= 1;
+        argv += 1;
+    }
+
+    if (!strcmp(command, "--search")) {
+        if (argc < 4)
+            FATAL("Missing expression or rom for '--search'");
+        search_expr = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
 
-    Chip8 *c = &(Chip8){0};
+    Chip8 *c = &(Chip8){ .rng = DEFAULT_RNG_SEED };
+    const char *rom = NULL;
+    size_t rom_size = 0;
+#ifdef EMBED_ROM
+    int embedded = 0;
+#endif
 
     {
         CmdLineArgs args = init_args_list(argc, argv);
-        const char *rom = NULL;
         parse_cmdline_args(c, &args, &rom);
-        chip8_load_to_mem(c, FONT_DATA_OFFSET, FONT_DATA, sizeof(FONT_DATA));
-        chip8_load_rom(c, rom);
+#ifdef EMBED_ROM
+        if (!rom) {
+            if (!c->config.engine_given)
+                c->config.engine = ENGINE_PREDECODE;
+            rom = EMBEDDED_ROM_NAME;
+            rom_size = chip8_load_embedded(c);
+            embedded = 1;
+        } else
+#endif
+        {
+            chip8_load_to_mem(c, FONT_DATA_OFFSET, FONT_DATA, sizeof(FONT_DATA));
+            // the launcher loads every rom into an instance of its own
+            if (!launcher)
+                rom_size = chip8_load_rom(c, rom);
+        }
+    }
+
+    if (launcher)
+        launcher_check_options(c);
+
+    if (c->config.instances)
+        batch_check_options(c);
+
+    if (c->config.checkpoint_path)
+        checkpoint_check_options(c);
+
+    if (resume)
+        checkpoint_check_rom(resume, c, rom_size);
+
+    static Checkpointer checkpointer;
+    Checkpointer *cp = NULL;
+    if (c->config.checkpoint_path) {
+        if (!c->config.headless_frames)
+            FATAL("-checkpoint has to be used with -headless");
+        cp = &checkpointer;
+        checkpoint_start(cp, c, rom_size, argc, argv);
+    }
+
+    if (log_level != LOG_OFF) {
+        log_start(c->config.log_path);
+        atexit(log_stop);
+    }
+
+    if (c->config.state_path)
+        archive_restore(c, c->config.state_path);
+
+    static ArchiveWriter archive_writer;
+    ArchiveWriter *aw = NULL;
+    if (c->config.archive_path) {
+        aw = &archive_writer;
+        archive_open(aw, c->config.archive_path);
+    }
+
+    if (search_expr) {
+        const uint32_t ips = c->config.instructions_per_frame ? c->config.instructions_per_frame : DEFAULT_IPS;
+        const uint32_t fps = c->config.frames_per_sec ? c->config.frames_per_sec : DEFAULT_FPS;
+        if (ips < fps)
+            FATAL("Instructions per second cannot be less than Frames per second. Use -h for more details");
+        return search_run(c, search_expr, ips / fps, aw);
+    }
+
+    if (c->config.instances) {
+        const uint32_t ips = c->config.instructions_per_frame ? c->config.instructions_per_frame : DEFAULT_IPS;
+        const uint32_t fps = c->config.frames_per_sec ? c->config.frames_per_sec : DEFAULT_FPS;
+        if (ips < fps)
+            FATAL("Instructions per second cannot be less than Frames per second. Use -h for more details");
+        if (!c->config.headless_frames)
+            FATAL("-instances has to be used with -headless");
+        return batch_run(c, c->config.instances, c->config.headless_frames, ips / fps, cp, resume);
+    }
+
+    if (launcher) {
+        const uint32_t ips = c->config.instructions_per_frame ? c->config.instructions_per_frame : DEFAULT_IPS;
+        const uint32_t fps = c->config.frames_per_sec ? c->config.frames_per_sec : DEFAULT_FPS;
+        if (ips < fps)
+            FATAL("Instructions per second cannot be less than Frames per second. Use -h for more details");
+        return launcher_run(c, ips / fps, fps);
+    }
+
+    // one buffer per recording thread
+    if (c->config.trace_path) {
+        ArenaPages pages;
+        TraceBuffer *trace_buffers = platform_map_arena(2 * sizeof(TraceBuffer), 0, &pages);
+        if (!trace_buffers)
+            FATAL("Failed to map the trace buffers");
+        trace_main = &trace_buffers[0];
+        trace_main->name = "emulation";
+        trace_compiler = &trace_buffers[1];
+        trace_compiler->name = "tiered compiler";
+    }
+
+    static Profile profile = {0};
+    if (c->config.coverage_path || c->config.heatmap)
+        c->profile = &profile;
+
+    static Predecode predecode = {0};
+    if (c->config.engine == ENGINE_PREDECODE)
+        c->predecode = &predecode;
+
+#ifdef EMBED_ROM
+    // a restored state may have rewritten the rom, those entries decode again
+    if (c->predecode && embedded) {
+        for (uint32_t i = 0; i < EMBEDDED_ROM_SIZE; ++i) {
+            if (tcache_entry_matches(c->mem, &EMBEDDED_OPS[i], PROGRAM_START_OFFSET + i))
+                predecode.ops[PROGRAM_START_OFFSET + i] = EMBEDDED_OPS[i];
+        }
+    }
+#endif
+
+    static uint8_t pristine_mem[MEM_SIZE];
+    char tcache_file[TCACHE_PATH_SIZE];
+    if (c->predecode && c->config.tcache_dir) {
+        memcpy(pristine_mem, c->mem, MEM_SIZE);
+        c->predecode->count_hits = 1;
+        tcache_path(tcache_file, c->config.tcache_dir, &c->mem[PROGRAM_START_OFFSET], rom_size, c->config.quirks);
+        tcache_load(c->predecode, c, rom_size, tcache_file);
+    }
+
+    static Tiered tiered = {0};
+    if (c->config.engine == ENGINE_TIERED) {
+        c->tiered = &tiered;
+        tiered_start(c->tiered);
+
+        // warm start from the hot blocks a predecode run left in the cache
+        if (c->config.tcache_dir) {
+            static Predecode hints = {0};
+            tcache_path(tcache_file, c->config.tcache_dir, &c->mem[PROGRAM_START_OFFSET], rom_size, c->config.quirks);
+            if (tcache_load(&hints, c, rom_size, tcache_file)) {
+                for (uint32_t i = 0; i < hints.hot_count; ++i) {
+                    if (hints.hot_blocks[i] + 2 <= MEM_SIZE)
+                        tiered_request(c->tiered, c, hints.hot_blocks[i]);
+                }
+            }
+        }
     }
 
     const uint32_t instructions_per_sec = c->config.instructions_per_frame ?
@@ -616,6 +5363,130 @@ int main(int argc, const char **argv) {
     if (instructions_per_sec < frames_per_sec)
         FATAL("Instructions per second cannot be less than Frames per second. Use -h for more details");
 
+    const uint32_t instructions_per_frame = instructions_per_sec/frames_per_sec;
+    Chip8 *snapshot = &(Chip8){0};
+
+    if (!c->config.netplay_port != !c->config.netplay_peer)
+        FATAL("-netplay and -peer have to be used together");
+
+    // the headless loop runs on its own without waiting for a peer
+    if (c->config.netplay_port && c->config.headless_frames)
+        FATAL("-netplay can not be used with -headless");
+
+    static Governor governor_state = {0};
+    Governor *governor = NULL;
+    if (c->config.governor_min_ips) {
+        if (c->config.governor_min_ips < frames_per_sec || c->config.governor_min_ips > instructions_per_sec)
+            FATAL("-governor has to be between FPS and IPS");
+
+        // both netplay peers have to run the same instructions every frame
+        if (c->config.netplay_port)
+            FATAL("-governor can not be used with -netplay");
+
+        governor = &governor_state;
+        *governor = (Governor){
+            .ipf = instructions_per_frame,
+            .min_ipf = c->config.governor_min_ips / frames_per_sec,
+            .max_ipf = instructions_per_frame,
+        };
+        printf("governor: %u-%u ips\n", c->config.governor_min_ips, instructions_per_sec);
+    }
+
+    uint32_t first_frame = 0;
+    if (resume) {
+        if (!c->config.headless_frames)
+            FATAL("--resume needs a checkpoint of a -headless run");
+        first_frame = checkpoint_restore(resume, c, governor);
+    }
+
+    static Netplay netplay_state = {0};
+    Netplay *np = NULL;
+    if (c->config.netplay_port) {
+        np = &netplay_state;
+        netplay_start(np, c->config.netplay_port, c->config.netplay_peer);
+    }
+
+    static MemSearch memsearch_state = {0};
+    MemSearch *ms = NULL;
+    if (c->config.memsearch_path) {
+        ms = &memsearch_state;
+        memsearch_start(ms, c, c->config.memsearch_path);
+    }
+
+    static DrawStream draw_state;
+    DrawStream *ds = NULL;
+    if (c->config.draw_path) {
+        ds = &draw_state;
+        draw_stream_open(ds, c->config.draw_path, c->config.draw_keyframes, frames_per_sec, !c->config.headless_frames);
+        c->draws = ds;
+    }
+
+    if (c->config.headless_frames) {
+        // reference instance stepped by the plain interpreter for -diffcheck
+        Chip8 *reference = &(Chip8){0};
+        memcpy(reference, c, sizeof(*reference));
+        reference->profile = NULL;
+        reference->predecode = NULL;
+        reference->tiered = NULL;
+        reference->draws = NULL;
+
+        for (uint32_t frame = first_frame; frame < c->config.headless_frames; ++frame) {
+            if (ms) {
+                memsearch_update(ms, c);
+                memsearch_apply_freezes(ms, c);
+                memsearch_apply_freezes(ms, reference);
+            }
+
+            const uint64_t frame_start = latency_frame_start();
+            const uint32_t budget = governor ? governor->ipf : instructions_per_frame;
+
+            uint64_t phase_start = trace_begin(trace_main);
+            chip8_run_timed(c, governor, budget);
+            trace_end(trace_main, TRACE_BATCH, phase_start);
+
+            phase_start = trace_begin(trace_main);
+            chip8_update_timers(c);
+            trace_end(trace_main, TRACE_TIMERS, phase_start);
+
+            if (aw)
+                archive_add(aw, c);
+
+            if (ds)
+                draw_stream_frame(ds, c);
+
+            if (c->config.runahead) {
+                phase_start = trace_begin(trace_main);
+                chip8_run_ahead(c, snapshot, governor ? governor->ipf : budget, 0);
+                trace_end(trace_main, TRACE_RUNAHEAD, phase_start);
+            }
+            trace_end(trace_main, TRACE_FRAME, frame_start);
+            stats_note_first_frame();
+
+            if (c->config.latency_dump_frames && (frame + 1) % c->config.latency_dump_frames == 0)
+                latency_dump();
+
+            if (c->config.diffcheck) {
+                chip8_interpret(reference, budget);
+                chip8_update_timers(reference);
+
+                if (!chip8_state_equal(c, reference))
+                    FATAL("diffcheck: state diverged from the interpreter at frame %u (pc: %u, interpreter pc: %u)",
+                            frame, c->pc, reference->pc);
+            }
+
+            if (cp && (frame + 1) % CHECKPOINT_CHECK_FRAMES == 0 && checkpoint_due(cp))
+                checkpoint_write(cp, c, frame + 1, governor ? governor->ipf : 0);
+        }
+
+        // a finished job resumes to its results
+        if (cp)
+            checkpoint_write(cp, c, c->config.headless_frames, governor ? governor->ipf : 0);
+
+        if (c->config.diffcheck)
+            printf("diffcheck: %u frames match the interpreter\n", c->config.headless_frames);
+        goto export;
+    }
+
     if (!platform_setup())
         FATAL("Failed to setup platform");
 
@@ -625,26 +5496,111 @@ int main(int argc, const char **argv) {
             c->config.bg_text);
 
 
-    while (1) {
+    for (uint64_t frame = 1;; ++frame) {
+        const uint64_t frame_start = latency_frame_start();
 
-        for (uint32_t i = 0; i < instructions_per_sec/frames_per_sec; ++i) {
-            uint16_t instruction = chip8_fetch(c);
-            chip8_decode_execute(c, instruction);
+        if (ms) {
+            memsearch_update(ms, c);
+            memsearch_apply_freezes(ms, c);
         }
 
-        c->delay_timer -= c->delay_timer != 0;
-        c->sound_timer -= c->sound_timer != 0 ? platform_beep() : 0;
-        chip8_display(c);
+        uint64_t phase_start = trace_begin(trace_main);
+        if (np) {
+            // netplay steps the timers along with every simulated frame
+            netplay_advance(np, c, instructions_per_frame);
+            trace_end(trace_main, TRACE_BATCH, phase_start);
+            if (c->sound_timer)
+                platform_beep();
+        } else {
+            chip8_run_timed(c, governor, instructions_per_frame);
+            trace_end(trace_main, TRACE_BATCH, phase_start);
+
+            phase_start = trace_begin(trace_main);
+            c->delay_timer -= c->delay_timer != 0;
+            c->sound_timer -= c->sound_timer != 0 ? platform_beep() : 0;
+            trace_end(trace_main, TRACE_TIMERS, phase_start);
+        }
+        if (aw)
+            archive_add(aw, c);
+
+        if (ds)
+            draw_stream_frame(ds, c);
+
+        if (c->config.heatmap)
+            heatmap_update(c->profile);
 
-        if (platform_set_keystates(&c->keys)) {
-            if (KEY_DOWN(c->keys, CKEY_ESC))
-                goto quit;
+        if (c->config.runahead) {
+            phase_start = trace_begin(trace_main);
+            chip8_run_ahead(c, snapshot, governor ? governor->ipf : instructions_per_frame, 1);
+            trace_end(trace_main, TRACE_RUNAHEAD, phase_start);
+        } else {
+            chip8_display(c);
         }
 
+        phase_start = trace_begin(trace_main);
+        KeyStates *held = np ? &np->local_keys : &c->keys;
+        platform_set_keystates(held);
+        trace_end(trace_main, TRACE_INPUT_POLL, phase_start);
+
+        // the netplay peer keeps playing while this window is in the background
+        if (!np && platform_is_paused()) {
+            phase_start = trace_begin(trace_main);
+            platform_wait_while_paused(held);
+            trace_end(trace_main, TRACE_PAUSED, phase_start);
+        }
+
+        if (KEY_DOWN(*held, CKEY_ESC))
+            goto quit;
+
+        phase_start = platform_time_ns();
         platform_sleep(1000/frames_per_sec);
+        const uint64_t slept = platform_time_ns() - phase_start;
+        const uint64_t requested = 1000000ULL * (1000/frames_per_sec);
+        latency_record(LATENCY_SLEEP_OVERSHOOT, slept > requested ? slept - requested : 0);
+        trace_end(trace_main, TRACE_SLEEP, phase_start);
 
+        trace_end(trace_main, TRACE_FRAME, frame_start);
+        stats_note_first_frame();
+
+        if (c->config.latency_dump_frames && frame % c->config.latency_dump_frames == 0)
+            latency_dump();
     }
 
 quit:
     platform_revert();
+
+export:
+    if (c->config.coverage_path)
+        coverage_export(c->profile, rom, c->config.coverage_path);
+
+    if (c->predecode && c->config.tcache_dir)
+        tcache_save(c->predecode, pristine_mem, rom_size, c->config.quirks, tcache_file);
+
+    if (c->tiered)
+        tiered_stop(c->tiered);
+
+    if (np)
+        platform_udp_close(np->socket);
+
+    if (ms)
+        fclose(ms->commands);
+
+    if (aw)
+        archive_close(aw);
+
+    if (ds)
+        draw_stream_close(ds);
+
+    // after tiered_stop, the compiler thread no longer records
+    if (trace_main) {
+        trace_export((TraceBuffer *const[]) { trace_main, trace_compiler }, 2, c->config.trace_path);
+        platform_unmap_arena(trace_main, 2 * sizeof(TraceBuffer));
+        trace_main = trace_compiler = NULL;
+    }
+
+    if (c->config.print_stats)
+        print_stats(c);
+
+    if (c->config.print_latency)
+        latency_print(stdout, NULL);
 }
@@ -29,41 +29,111 @@ typedef enum {
 
     // for emulator exit
     CKEY_ESC,
+
+    // switches roms in the launcher, only mapped with platform_launcher_keys
+    CKEY_TAB,
 } Chip8Key;
 
 typedef uint32_t KeyStates;
 static inline const char *get_chip8key_name(Chip8Key key);
 static uint8_t keys[256];
+static int platform_is_setup = 0;
+static int platform_launcher_keys = 0;
 
 #ifdef __unix__
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dlfcn.h>
 #include <X11/XKBlib.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 typedef struct termios termios;
 
+// libX11 is only loaded once the X11 keyboard is set up, headless runs and
+// machines without it never need it. Only the types come from the headers
+#define X11_FUNCTIONS(X)                \
+    X(XOpenDisplay)                     \
+    X(XDisplayName)                     \
+    X(XCloseDisplay)                    \
+    X(XGetInputFocus)                   \
+    X(XSelectInput)                     \
+    X(XPending)                         \
+    X(XNextEvent)                       \
+    X(XkbSetDetectableAutoRepeat)       \
+    X(XkbGetMap)                        \
+    X(XkbGetNames)                      \
+    X(XkbFreeNames)                     \
+    X(XkbFreeKeyboard)
+
+#define X11_DECLARE(name)       __typeof__(name) *name;
+static struct {
+    void *library;
+    X11_FUNCTIONS(X11_DECLARE)
+} x11 = {0};
+
 static termios  original_termios = {0};
 static Display *x11display = NULL;
 static Window   terminal_emulator_window = 0;
+static int      x11_focused = 1;
+static int      x11_visible = 1;
+
+static inline
+int load_x11(void) {
+    if (x11.library)
+        return 1;
+
+    if (!(x11.library = dlopen("libX11.so.6", RTLD_NOW | RTLD_LOCAL)) &&
+        !(x11.library = dlopen("libX11.so", RTLD_NOW | RTLD_LOCAL))) {
+        fprintf(stderr, "Failed to load libX11: %s\n", dlerror());
+        return 0;
+    }
+
+#define X11_LOAD(name)                                                  \
+    if (!(*(void **)&x11.name = dlsym(x11.library, #name))) {          \
+        fprintf(stderr, "Failed to find %s in libX11\n", #name);       \
+        return 0;                                                       \
+    }
+    X11_FUNCTIONS(X11_LOAD)
+#undef X11_LOAD
+
+    return 1;
+}
 
 static inline
 int setup_x11_keyboard(void) {
 
-    if (!(x11display = XOpenDisplay(NULL))) {
-        fprintf(stderr, "Failed to open X11 display: %s\n", XDisplayName(NULL));
+    if (!load_x11())
+        return 0;
+
+    if (!(x11display = x11.XOpenDisplay(NULL))) {
+        fprintf(stderr, "Failed to open X11 display: %s\n", x11.XDisplayName(NULL));
         return 0;
     }
 
     int revert_to;
-    XGetInputFocus(x11display, &terminal_emulator_window, &revert_to);
+    x11.XGetInputFocus(x11display, &terminal_emulator_window, &revert_to);
     if (terminal_emulator_window == 0) {
         fprintf(stderr, "Failed to get terminal emulator X11 window\n");
         return 0;
     }
 
-    XSelectInput(x11display, terminal_emulator_window, KeyPressMask | KeyReleaseMask );
+    x11.XSelectInput(x11display, terminal_emulator_window,
+            KeyPressMask | KeyReleaseMask | FocusChangeMask | VisibilityChangeMask);
 
-    if (!XkbSetDetectableAutoRepeat(x11display, True, NULL)) {
+    if (!x11.XkbSetDetectableAutoRepeat(x11display, True, NULL)) {
         fprintf(stderr, "Failed to set detectable autorepeat\n");
         return 0;
     }
@@ -89,15 +159,17 @@ int setup_x11_keyboard(void) {
         { .key_name = "AB02", .key = CKEY_X},
         { .key_name = "AB03", .key = CKEY_C},
         { .key_name = "AB04", .key = CKEY_V},
+        { .key_name = "TAB",  .key = CKEY_TAB},
     };
+    const size_t name_key_count = sizeof(name_keys)/sizeof(name_keys[0]) - !platform_launcher_keys;
 
-    XkbDescPtr xkbdesc = XkbGetMap(x11display, 0, XkbUseCoreKbd);
-    XkbGetNames(x11display, XkbKeyNamesMask, xkbdesc);
+    XkbDescPtr xkbdesc = x11.XkbGetMap(x11display, 0, XkbUseCoreKbd);
+    x11.XkbGetNames(x11display, XkbKeyNamesMask, xkbdesc);
 
     memset(keys, -1, sizeof(keys));
 
     for(KeyCode i = xkbdesc->min_key_code; i < xkbdesc->max_key_code; ++i) {
-        for(size_t j = 0; j < sizeof(name_keys)/sizeof(name_keys[0]); ++j) {
+        for(size_t j = 0; j < name_key_count; ++j) {
             if(strncmp(name_keys[j].key_name, xkbdesc->names->keys[i].name, XkbKeyNameLength) == 0) {
                 keys[i] = name_keys[j].key;
                 break;
@@ -105,8 +177,8 @@ int setup_x11_keyboard(void) {
         }
     }
 
-    XkbFreeNames(xkbdesc, XkbNamesMask, True);
-    XkbFreeKeyboard(xkbdesc, 0, True);
+    x11.XkbFreeNames(xkbdesc, XkbNamesMask, True);
+    x11.XkbFreeKeyboard(xkbdesc, 0, True);
 
     return 1;
 }
@@ -149,7 +221,10 @@ int disable_terminal_raw_mode(void) {
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <conio.h>
+#include <io.h>
 
 static HANDLE hStdin = NULL;
 static DWORD original_in_mode = 0;
@@ -210,6 +285,9 @@ int enable_stdout_ansi_code_processing(void) {
 
     mode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING | DISABLE_NEWLINE_AUTO_RETURN;
 
+    // heatmap panel uses UTF-8 half block characters
+    SetConsoleOutputCP(CP_UTF8);
+
     if (!SetConsoleMode(hStdout, mode)) {
         perror("Failed to get out console mode");
         return 0;
@@ -229,7 +307,8 @@ int disable_stdout_ansi_code_processing(void) {
 
 #define PLATFORM_EOL "\r\n"
 
-static uint8_t keycodes[17];
+static uint8_t keycodes[18];
+static size_t keycode_count;
 
 static inline
 int setup_win32_keyboard(void) {
@@ -260,9 +339,12 @@ int setup_win32_keyboard(void) {
         { .scancode = 0x02D }, // X
         { .scancode = 0x02E }, // C
         { .scancode = 0x02F }, // V
+
+        { .scancode = 0x00F }, // TAB
     };
 
-    for (size_t i = 0; i < sizeof(keyinfo)/sizeof(keyinfo[0]); ++i) {
+    keycode_count = sizeof(keyinfo)/sizeof(keyinfo[0]) - !platform_launcher_keys;
+    for (size_t i = 0; i < keycode_count; ++i) {
         const UINT keycode = MapVirtualKey(keyinfo[i].scancode, MAPVK_VSC_TO_VK);
 
         if (!keycode) {
@@ -296,6 +378,9 @@ int setup_win32_keyboard(void) {
     keys[keyinfo[15].keycode] = CKEY_C;
     keys[keyinfo[16].keycode] = CKEY_V;
 
+    if (platform_launcher_keys)
+        keys[keyinfo[17].keycode] = CKEY_TAB;
+
     return 1;
 }
 
@@ -319,6 +404,7 @@ int platform_setup(void) {
 #endif
 
     EXECUTE_ANSI_CODE("[?25l"); // make cursor invisible
+    platform_is_setup = 1;
     return 1;
 }
 
@@ -338,6 +424,11 @@ void platform_cursor_up(int n) {
 
 static inline
 int platform_revert(void) {
+    // nothing to restore when running headless
+    if (!platform_is_setup)
+        return 1;
+    platform_is_setup = 0;
+
     EXECUTE_ANSI_CODE("[0J");   // clear till end of screen
     EXECUTE_ANSI_CODE("[?25h"); // make cursor visible
 
@@ -345,7 +436,7 @@ int platform_revert(void) {
         return 0;
 
 #ifdef __unix__
-    XCloseDisplay(x11display);
+    x11.XCloseDisplay(x11display);
     tcflush(0, TCIFLUSH);
 #elif defined _WIN32
     if (!disable_stdout_ansi_code_processing())
@@ -363,9 +454,27 @@ int platform_set_keystates(KeyStates *keystates) {
 
 #ifdef __unix__
 
-    while (XPending(x11display)) {
+    while (x11.XPending(x11display)) {
         XEvent event;
-        XNextEvent(x11display, &event);
+        x11.XNextEvent(x11display, &event);
+
+        // focus moving into a child window keeps the keyboard with us
+        if ((event.type == FocusIn || event.type == FocusOut) && event.xfocus.detail != NotifyInferior) {
+            x11_focused = event.type == FocusIn;
+
+            // the key releases go to the other window
+            state_changed |= !x11_focused && *keystates;
+            *keystates = x11_focused ? *keystates : 0;
+            continue;
+        }
+
+        if (event.type == VisibilityNotify) {
+            x11_visible = event.xvisibility.state != VisibilityFullyObscured;
+            continue;
+        }
+
+        if (event.type != KeyPress && event.type != KeyRelease)
+            continue;
 
         const uint32_t xkeycode = event.xkey.keycode;
 
@@ -382,7 +491,7 @@ int platform_set_keystates(KeyStates *keystates) {
 
 #elif defined _WIN32
     KeyStates this_frame = 0;
-    for (size_t i = 0;i < sizeof(keycodes)/sizeof(keycodes[0]); ++i) {
+    for (size_t i = 0;i < keycode_count; ++i) {
         const uint8_t vkey = keycodes[i];
         if (GetAsyncKeyState(vkey) & (1<<15)) {
             const Chip8Key key = keys[vkey];
@@ -397,6 +506,36 @@ int platform_set_keystates(KeyStates *keystates) {
     return state_changed;
 }
 
+// There is no portable way to tell whether a console window has focus on windows
+static inline
+int platform_is_paused(void) {
+#ifdef __unix__
+    return !x11_focused || !x11_visible;
+#elif defined _WIN32
+    return 0;
+#endif
+}
+
+// Blocks on the X11 connection until the terminal window is focused and
+// visible again, nothing runs in the meantime
+static inline
+void platform_wait_while_paused(KeyStates *keystates) {
+#ifdef __unix__
+    const int fd = ConnectionNumber(x11display);
+    while (platform_is_paused()) {
+        if (!x11.XPending(x11display)) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(fd, &fds);
+            select(fd + 1, &fds, NULL, NULL, NULL);
+        }
+        platform_set_keystates(keystates);
+    }
+#elif defined _WIN32
+    (void) keystates;
+#endif
+}
+
 static inline
 int platform_beep(void) {
     printf("\a");
@@ -414,6 +553,444 @@ void platform_write_to_console(const char *buffer, size_t buffer_size, uint32_t
     platform_cursor_up(no_of_lines);
 }
 
+// Maps a whole file read-only. Returns NULL if it does not exist or cannot be mapped
+static inline
+const void *platform_map_file(const char *file_path, size_t *size) {
+#ifdef __unix__
+    const int fd = open(file_path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        data = data == MAP_FAILED ? NULL : data;
+        *size = st.st_size;
+    }
+    close(fd);
+    return data;
+#elif defined _WIN32
+    HANDLE file = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER file_size;
+    void *data = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            *size = (size_t)file_size.QuadPart;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return data;
+#endif
+}
+
+static inline
+void platform_unmap_file(const void *data, size_t size) {
+#ifdef __unix__
+    munmap((void*)data, size);
+#elif defined _WIN32
+    (void) size;
+    UnmapViewOfFile(data);
+#endif
+}
+
+typedef enum {
+    ARENA_SMALL_PAGES,
+    ARENA_TRANSPARENT_HUGE_PAGES,   // asked for, the kernel may still use small pages
+    ARENA_HUGE_PAGES,
+} ArenaPages;
+
+#define ARENA_HUGE_PAGE_SIZE        (2u << 20)
+
+// Zeroed read/write memory, size is a multiple of ARENA_HUGE_PAGE_SIZE. With
+// huge set, reserved huge pages are tried before transparent huge pages
+static inline
+void *platform_map_arena(size_t size, int huge, ArenaPages *pages) {
+#ifdef __unix__
+    void *data = MAP_FAILED;
+    *pages = ARENA_SMALL_PAGES;
+#ifdef MAP_HUGETLB
+    if (huge) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        *pages = data == MAP_FAILED ? ARENA_SMALL_PAGES : ARENA_HUGE_PAGES;
+    }
+#endif
+    if (data == MAP_FAILED)
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (*pages != ARENA_HUGE_PAGES && !madvise(data, size, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) && huge)
+        *pages = ARENA_TRANSPARENT_HUGE_PAGES;
+#endif
+    return data;
+#elif defined _WIN32
+    // large pages need SeLockMemoryPrivilege, without it they fail and small pages are used
+    void *data = NULL;
+    *pages = ARENA_SMALL_PAGES;
+    if (huge && GetLargePageMinimum()) {
+        data = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        *pages = data ? ARENA_HUGE_PAGES : ARENA_SMALL_PAGES;
+    }
+    return data ? data : VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#endif
+}
+
+static inline
+void platform_unmap_arena(void *data, size_t size) {
+#ifdef __unix__
+    munmap(data, size);
+#elif defined _WIN32
+    (void) size;
+    VirtualFree(data, 0, MEM_RELEASE);
+#endif
+}
+
+// Counts data TLB misses of this thread from now on. Returns -1 where there
+// are no performance counters or no permission to use them
+static inline
+int platform_tlb_counter_open(void) {
+#ifdef __linux__
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+        PERF_COUNT_HW_CACHE_OP_READ << 8 |
+        PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static inline
+uint64_t platform_tlb_counter_close(int counter) {
+    uint64_t count = 0;
+#ifdef __linux__
+    if (read(counter, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+    close(counter);
+#else
+    (void) counter;
+#endif
+    return count;
+}
+
+static inline
+uint64_t platform_time_ns(void) {
+#ifdef __unix__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#elif defined _WIN32
+    static LARGE_INTEGER frequency = {0};
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1000000000.0 / frequency.QuadPart);
+#endif
+}
+
+// index of the highest set bit, value must not be 0
+static inline
+uint32_t platform_highest_bit_u64(uint64_t value) {
+#ifdef __unix__
+    return 63 - __builtin_clzll(value);
+#elif defined _WIN32
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return index;
+#endif
+}
+
+// CPU time of the whole process so far, including the work of the dynamic loader before main
+static inline
+uint64_t platform_process_cpu_ns(void) {
+#ifdef __unix__
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#elif defined _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    const uint64_t k = (uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+    const uint64_t u = (uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime;
+    return (k + u) * 100;
+#endif
+}
+
+// threads and the few atomics needed to hand data between them
+#ifdef __unix__
+typedef pthread_t PlatformThread;
+typedef void *(*PlatformThreadFunc)(void *);
+#define THREAD_FUNC(name)               void *name(void *arg)
+#define THREAD_RETURN                   return NULL
+#elif defined _WIN32
+typedef HANDLE PlatformThread;
+typedef DWORD (WINAPI *PlatformThreadFunc)(LPVOID);
+#define THREAD_FUNC(name)               DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN                   return 0
+#endif
+
+static inline
+void *platform_atomic_load_ptr(void *const *ptr) {
+#ifdef __unix__
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#elif defined _WIN32
+    return InterlockedCompareExchangePointer((PVOID volatile *)ptr, NULL, NULL);
+#endif
+}
+
+static inline
+void platform_atomic_store_ptr(void **ptr, void *value) {
+#ifdef __unix__
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#elif defined _WIN32
+    InterlockedExchangePointer((PVOID volatile *)ptr, value);
+#endif
+}
+
+static inline
+uint32_t platform_atomic_load_u32(const uint32_t *ptr) {
+#ifdef __unix__
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#elif defined _WIN32
+    return InterlockedCompareExchange((LONG volatile *)ptr, 0, 0);
+#endif
+}
+
+static inline
+void platform_atomic_store_u32(uint32_t *ptr, uint32_t value) {
+#ifdef __unix__
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#elif defined _WIN32
+    InterlockedExchange((LONG volatile *)ptr, value);
+#endif
+}
+
+// returns the value before the add
+static inline
+uint32_t platform_atomic_add_u32(uint32_t *ptr, uint32_t value) {
+#ifdef __unix__
+    return __atomic_fetch_add(ptr, value, __ATOMIC_ACQ_REL);
+#elif defined _WIN32
+    return InterlockedExchangeAdd((LONG volatile *)ptr, value);
+#endif
+}
+
+// returns the value found at ptr, the swap happened if that equals expected
+static inline
+uint64_t platform_atomic_cas_u64(uint64_t *ptr, uint64_t expected, uint64_t desired) {
+#ifdef __unix__
+    __atomic_compare_exchange_n(ptr, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return expected;
+#elif defined _WIN32
+    return InterlockedCompareExchange64((LONG64 volatile *)ptr, desired, expected);
+#endif
+}
+
+#ifdef __unix__
+typedef pthread_mutex_t PlatformMutex;
+#elif defined _WIN32
+typedef CRITICAL_SECTION PlatformMutex;
+#endif
+
+static inline
+void platform_mutex_init(PlatformMutex *mutex) {
+#ifdef __unix__
+    pthread_mutex_init(mutex, NULL);
+#elif defined _WIN32
+    InitializeCriticalSection(mutex);
+#endif
+}
+
+static inline
+void platform_mutex_destroy(PlatformMutex *mutex) {
+#ifdef __unix__
+    pthread_mutex_destroy(mutex);
+#elif defined _WIN32
+    DeleteCriticalSection(mutex);
+#endif
+}
+
+static inline
+void platform_mutex_lock(PlatformMutex *mutex) {
+#ifdef __unix__
+    pthread_mutex_lock(mutex);
+#elif defined _WIN32
+    EnterCriticalSection(mutex);
+#endif
+}
+
+static inline
+void platform_mutex_unlock(PlatformMutex *mutex) {
+#ifdef __unix__
+    pthread_mutex_unlock(mutex);
+#elif defined _WIN32
+    LeaveCriticalSection(mutex);
+#endif
+}
+
+static inline
+uint32_t platform_cpu_count(void) {
+#ifdef __unix__
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+#elif defined _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#endif
+}
+
+static inline
+int platform_thread_start(PlatformThread *thread, PlatformThreadFunc func, void *arg) {
+#ifdef __unix__
+    return pthread_create(thread, NULL, func, arg) == 0;
+#elif defined _WIN32
+    return (*thread = CreateThread(NULL, 0, func, arg, 0, NULL)) != NULL;
+#endif
+}
+
+static inline
+void platform_thread_join(PlatformThread thread) {
+#ifdef __unix__
+    pthread_join(thread, NULL);
+#elif defined _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#endif
+}
+
+// non-blocking UDP sockets
+#ifdef __unix__
+typedef int PlatformSocket;
+#define INVALID_PLATFORM_SOCKET         -1
+#elif defined _WIN32
+typedef SOCKET PlatformSocket;
+#define INVALID_PLATFORM_SOCKET         INVALID_SOCKET
+#endif
+
+typedef struct sockaddr_in PlatformAddress;
+
+static inline
+PlatformSocket platform_udp_open(uint16_t port) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        return INVALID_PLATFORM_SOCKET;
+#endif
+
+    PlatformSocket sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_PLATFORM_SOCKET)
+        return sock;
+
+    PlatformAddress addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    int ok = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+#ifdef __unix__
+    ok = ok && fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == 0;
+    if (!ok) {
+        close(sock);
+        return INVALID_PLATFORM_SOCKET;
+    }
+#elif defined _WIN32
+    u_long nonblocking = 1;
+    ok = ok && ioctlsocket(sock, FIONBIO, &nonblocking) == 0;
+    if (!ok) {
+        closesocket(sock);
+        return INVALID_PLATFORM_SOCKET;
+    }
+#endif
+    return sock;
+}
+
+static inline
+void platform_udp_close(PlatformSocket sock) {
+#ifdef __unix__
+    close(sock);
+#elif defined _WIN32
+    closesocket(sock);
+    WSACleanup();
+#endif
+}
+
+// host_port is "<host>:<port>"
+static inline
+int platform_udp_resolve(const char *host_port, PlatformAddress *out) {
+    char host[256];
+    const char *colon = strrchr(host_port, ':');
+    if (!colon || (size_t)(colon - host_port) >= sizeof(host))
+        return 0;
+
+    memcpy(host, host_port, colon - host_port);
+    host[colon - host_port] = '\0';
+
+    struct addrinfo hints = {0}, *result = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0 || !result)
+        return 0;
+
+    memcpy(out, result->ai_addr, sizeof(*out));
+    freeaddrinfo(result);
+    return 1;
+}
+
+static inline
+int platform_udp_send(PlatformSocket sock, const PlatformAddress *to, const void *data, size_t size) {
+    return sendto(sock, data, size, 0, (const struct sockaddr *)to, sizeof(*to)) == (int)size;
+}
+
+// returns the datagram size, or -1 when nothing is queued
+static inline
+int platform_udp_recv(PlatformSocket sock, void *data, size_t size) {
+    return recvfrom(sock, data, size, 0, NULL, NULL);
+}
+
+static inline
+void platform_udp_wait(PlatformSocket sock, uint32_t milliseconds) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = milliseconds * 1000 };
+    select((int)sock + 1, &fds, NULL, NULL, &timeout);
+}
+
+// flushes a written stream down to the disk, so a rename after it survives a power loss
+static inline
+int platform_sync_file(FILE *file) {
+    if (fflush(file))
+        return 0;
+#ifdef __unix__
+    return fsync(fileno(file)) == 0;
+#elif defined _WIN32
+    return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(file))) != 0;
+#endif
+}
+
+// rename() on windows fails if the destination exists
+static inline
+int platform_replace_file(const char *from, const char *to) {
+#ifdef __unix__
+    return rename(from, to) == 0;
+#elif defined _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#endif
+}
+
 static inline
 const char *get_chip8key_name(Chip8Key key) {
     switch (key) {
@@ -434,6 +1011,7 @@ const char *get_chip8key_name(Chip8Key key) {
     case CKEY_C:    return "B";
     case CKEY_V:    return "F";
     case CKEY_ESC:  return "ESC";
+    case CKEY_TAB:  return "TAB";
     }
     return "<unknown>";
 }
@@ -498,4 +1076,15 @@ uint32_t parse_option_value_to_uint(CmdLineArgs *args, int radix) {
     return value;
 }
 
+static inline
+const char* parse_option_value_to_str(CmdLineArgs *args) {
+    const char *option_name = args->argv[args->next - 1];
+    const char *arg = next_arg(args);
+
+    if (!arg || !*arg)
+        FATAL("Missing argument for '%s'", option_name);
+
+    return arg;
+}
+
 #endif // PLATFORM_H